@@ -15,12 +15,19 @@ namespace rdma {
 
 constexpr uint8_t kRpcNewConnection = UINT8_MAX;
 constexpr uint8_t kRpcResponse = UINT8_MAX - 1;
+constexpr uint8_t kRpcStreamChunk = UINT8_MAX - 2;
+constexpr uint8_t kRpcStreamAck = UINT8_MAX - 3;  // the lowest reserved rpc_id.
 constexpr int kMTU = 4096;
 constexpr int kUDHeaderSize = sizeof(ibv_grh);
 
 struct RpcContext;
+struct RecvPool;
+struct RCRecvBuf;
+struct RingSession;
 struct ReqHandle;
 struct RpcSession;
+struct RpcStream;
+struct LocalChannel;
 struct MsgBuf;
 struct Rpc;
 
@@ -77,13 +84,49 @@ struct RpcContext {
     RpcContext(const std::string &rpc_ip, int rpc_port, int id, int numa = 0, uint8_t dev_port = 0,
                int gid_index = Context::kGIDAuto, int proto = Context::kInfiniBand, const char *ipv4_subnet = nullptr);
 
-    inline void regFunc(uint8_t rpc_id, std::function<void(ReqHandle *, void *)> func) {
-        if (rpc_id == kRpcNewConnection || rpc_id == kRpcResponse) {
-            LOG(ERROR) << "rpc_id should not be NewConnection or Response";
+    // A dispatched handler runs in the dispatch workers of the Rpc (see Rpc::enableDispatch)
+    // instead of inline in the poller, use it for slow handlers.
+    inline void regFunc(uint8_t rpc_id, std::function<void(ReqHandle *, void *)> func, bool dispatch = false) {
+        if (rpc_id >= kRpcStreamAck) {
+            LOG(ERROR) << "rpc_id " << (int)rpc_id << " is reserved";
             return;
         }
         is_server = true;
         funcs[rpc_id] = func;
+        raw_funcs[rpc_id] = nullptr;
+        dispatched[rpc_id] = dispatch;
+    }
+
+    // Same as regFunc with a plain function, which saves the std::function indirection.
+    inline void regRawFunc(uint8_t rpc_id, void (*func)(ReqHandle *, void *), bool dispatch = false) {
+        if (rpc_id >= kRpcStreamAck) {
+            LOG(ERROR) << "rpc_id " << (int)rpc_id << " is reserved";
+            return;
+        }
+        is_server = true;
+        raw_funcs[rpc_id] = func;
+        dispatched[rpc_id] = dispatch;
+    }
+
+    // Streaming handler (see rpc/stream.h): each call builds the next chunk in handle->buf->send_buf
+    // from the request in handle->buf->recv_buf, and returns false for the last one. Runs in the poller.
+    inline void regStreamFunc(uint8_t rpc_id, std::function<bool(ReqHandle *, void *)> func) {
+        if (rpc_id >= kRpcStreamAck) {
+            LOG(ERROR) << "rpc_id " << (int)rpc_id << " is reserved";
+            return;
+        }
+        is_server = true;
+        stream_funcs[rpc_id] = func;
+        streamed[rpc_id] = true;
+    }
+
+    inline void invoke(uint8_t rpc_id, ReqHandle *handle, void *context) {
+        auto raw = raw_funcs[rpc_id];
+        if (likely(raw != nullptr)) {
+            raw(handle, context);
+        } else {
+            funcs[rpc_id](handle, context);
+        }
     }
 
     MsgBuf *allocBuf();
@@ -95,6 +138,16 @@ struct RpcContext {
     int numa;
     Context ctx;
     std::function<void(ReqHandle *, void *)> funcs[UINT8_MAX + 1];
+    void (*raw_funcs[UINT8_MAX + 1])(ReqHandle *, void *){};
+    std::function<bool(ReqHandle *, void *)> stream_funcs[UINT8_MAX + 1];
+    bool streamed[UINT8_MAX + 1]{};
+    bool dispatched[UINT8_MAX + 1]{};
+
+    // Receive pool shared by the Rpcs of this context (SRQ mode).
+    RecvPool *shared_recv_pool{};
+    std::mutex shared_recv_pool_mtx;
+    // Serializes the binding of connect handlers on the manager.
+    std::mutex bind_mtx;
 };
 
 constexpr int kMsgBufAlign = 16;
@@ -121,36 +174,24 @@ public:
     uint8_t buf[kMTU - sizeof(RpcHeader)];
 };
 
-struct alignas(kCacheLineSize) ShmRpcRingSlot {
-    // cache line 0
-    uint64_t turn_;
-    bool finished_;
-    uint8_t rpc_id;
-    // For cache friendliness, don't use recv_buf.size and send_buf.size.
-    uint32_t recv_buf_size;
-    uint32_t send_buf_size;
-
-    // cache line 1
-    MsgBuf recv_buf;
-    MsgBuf send_buf;
-    std::atomic<uint64_t> *turn() {
-        return reinterpret_cast<std::atomic<uint64_t> *>(&turn_);
-    }
-    std::atomic<bool> *finished() {
-        return reinterpret_cast<std::atomic<bool> *>(&finished_);
-    }
-};
-
 struct MsgBufPair {
     MsgBufPair(RpcContext *ctx, bool alloc_recv_buf = false) : finished(false) {
         send_buf = ctx->allocBuf();
         recv_buf = alloc_recv_buf ? ctx->allocBuf() : nullptr;  // wait for recv() to fill in this.
     }
 
-    MsgBufPair(ShmRpcRingSlot *slot, uint64_t ticket) {
-        send_buf = &slot->send_buf;
-        recv_buf = &slot->recv_buf;
-        this->ticket = ticket;
+    MsgBufPair(MsgBuf *send_buf, MsgBuf *recv_buf) : send_buf(send_buf), recv_buf(recv_buf), finished(false) {}
+
+    // Called by the poller when the response is in recv_buf.
+    inline void complete() {
+        if (callback != nullptr) {
+            // The callback may send again with this pair.
+            auto cb = callback;
+            callback = nullptr;
+            cb(this, callback_arg);
+        } else {
+            finished.store(true, std::memory_order_release);
+        }
     }
 
     MsgBuf *send_buf;
@@ -158,6 +199,19 @@ struct MsgBufPair {
     RpcSession *session;
     uint64_t ticket;  // Ticket for shm.
     std::atomic<bool> finished;
+    RpcStream *stream{};  // stream opened by this request.
+    // Continuation of Rpc::sendAsync, runs instead of setting finished.
+    void (*callback)(MsgBufPair *, void *){};
+    void *callback_arg{};
+    // Receive buffer that holds the response in recv_buf, lent by the UD recv pool, the RC session or
+    // a slot of the write ring until Rpc::releaseResponse.
+    RecvPool *rx_pool{};
+    MsgBufPair *rx_pair{};
+    RCRecvBuf *rx_rc{};
+    RingSession *rx_ring{};
+    // Response buffer of the copying shm and in-process paths, the pair's own from its first such request.
+    MsgBuf *own_recv{};
+    bool keep_response{};  // set by a callback when the response is read after it returns.
 };
 
 }  // namespace rdma
@@ -0,0 +1,58 @@
+#ifndef RDMA_RPC_CORO_RPC_H_
+#define RDMA_RPC_CORO_RPC_H_
+
+#include "rdma/rpc/rpc.h"
+#include "utils/coroutine.h"
+
+namespace rdma {
+
+// Coroutine mode of an Rpc, header only so that the rdma library does not depend on boost.
+// Rpc::recv() in a coroutine parks it until the response arrives, and coro_scheduler polls
+// the Rpc once per round over its coroutines, resuming only those whose responses came back.
+// A round is one poll of the blocking recv(): a waiter still parked after retry_times of them has its
+// request cancelled and recv() returns false. In-process requests are never lost, they wait on.
+// Outside of a coroutine recv() still spins. The Rpc and the scheduler must belong to the same thread.
+struct CoroWait {
+    MsgBufPair *buf;
+    size_t left;  // rounds before the waiter gives up.
+    bool timed_out;
+};
+inline thread_local CoroWait coro_waits[kMaxCoroutinesPerThread];
+
+inline void coroAttach(Rpc *rpc) {
+    rpc->setWaitHook(
+        [](MsgBufPair *buf, size_t retry_times, void *) {
+            if (!coro_scheduler.inCoroutine() || retry_times == 0) return Rpc::kWaitUnhandled;
+            buf->callback = [](MsgBufPair *buf, void *id) {
+                // Read by the coroutine once it runs again.
+                buf->keep_response = true;
+                coro_scheduler.wake((int)(intptr_t)id);
+            };
+            int id = coro_scheduler.coro_id();
+            buf->callback_arg = (void *)(intptr_t)id;
+            coro_waits[id] = CoroWait{ buf, retry_times, false };
+            coro_scheduler.park();
+            bool timed_out = coro_waits[id].timed_out;
+            coro_waits[id].buf = nullptr;
+            return timed_out ? Rpc::kWaitTimeout : Rpc::kWaitDone;
+        },
+        nullptr);
+    coro_scheduler.setIdle(
+        [](void *arg) {
+            Rpc *rpc = (Rpc *)arg;
+            rpc->poll();
+            for (int id = 0; id < (int)coro_scheduler.size(); ++id) {
+                CoroWait &w = coro_waits[id];
+                if (w.buf == nullptr || !coro_scheduler.parked_[id] || w.left == UINT64_MAX) continue;
+                if (w.buf->session->transport == RpcTransport::kLocal || --w.left > 0) continue;
+                rpc->cancel(w.buf);
+                w.timed_out = true;
+                coro_scheduler.wake(id);
+            }
+        },
+        rpc);
+}
+
+}  // namespace rdma
+
+#endif  // RDMA_RPC_CORO_RPC_H_
@@ -1,117 +1,120 @@
 #ifndef RDMA_RPC_RC_RPC_H_
 #define RDMA_RPC_RC_RPC_H_
 
-#include <unordered_map>
-
 #include "rdma/context.h"
 #include "rdma/qp.h"
 #include "rdma/rpc/common.h"
-#include "rdma/rpc/shm.h"
 
 namespace rdma {
 
+// Building blocks of the RC transports of Rpc (RC send/recv and RDMA write ring).
+
+// The send CQ of RC QPs is shared, so each QP keeps its own send queue accounting:
+// every kRCSignalBatch-th WR is signaled with the QPCnt in wr_id and retires kRCSignalBatch WRs.
+constexpr int kRCSignalBatch = Context::kQueueDepth / 2;
+// Signaled WRs a QP has in flight at most, what it may leave in the shared send CQ.
+constexpr int kRCSignaledPerQP = Context::kQueueDepth / kRCSignalBatch;
+
 struct QPCnt {
     QP *qp;
-    int send_cnt;
+    int send_cnt;  // WRs since the last signaled one.
     std::string oppo_ip;
     int oppo_port;
     int oppo_id;
+    int inflight{};  // posted WRs not yet retired.
+    // RC client: receives posted and not claimed by a request in flight or a stream, see RCRecvBuf.
+    int credits{};
+    RCRecvBuf *recvs{};  // RC client, the credits it started with.
+    int recv_cnt{};
 };
 
-// Single thread without coroutine.
-// Out-of-order response is not supported.
-struct Rpc {
-    Rpc(RpcContext *rpc_ctx, void *context, int qp_id);
-
-    // Client API.
-    RpcSession connect(const std::string &ctx_ip, int ctx_port, int qp_id);
-    void send(RpcSession *session, uint8_t rpc_id, MsgBufPair *buf);
-    bool recv(MsgBufPair *msg, size_t retry_times = UINT64_MAX);
-
-    // Server API.
-    void runServerLoopOnce();
-    void handleQPRequests();
-    void handleSHMRequests();
-    void postNextGroupRecv();
-    static constexpr int kSrvBufCnt = 1024;
-
-    MsgBufPair *srv_bufs;
-    static constexpr int kRecvWrGroupCnt = 2;
-    static constexpr int kRecvWrGroupSize = kSrvBufCnt / kRecvWrGroupCnt;
-    ibv_sge *srv_recv_sges;
-    ibv_recv_wr *srv_recv_wrs;
-    ibv_recv_wr *srv_recv_wr_hdrs[kRecvWrGroupCnt];
-    int cur_group;
-    ibv_srq *srv_srq;
-    ibv_cq *send_cq, *recv_cq;  // shared CQ for every srv QPs.
-    int send_cnt;               // total send count.
-    std::unordered_map<int, QPCnt> qpn_qp_map;
-
-    template<class T, size_t sz>
-    struct RingBuffer {
-        T req_handles[sz + 1];
-        T *ql{}, *qr{};
-        RingBuffer() {
-            ql = qr = &req_handles[0];
-        }
-        inline ReqHandle *pop() {
-            if (unlikely(ql == qr)) {
-                return nullptr;
-            }
-            T ret = *(ql++);
-            if (ql > req_handles + sz) {
-                ql = req_handles;
-            }
-            return ret;
-        }
-
-        inline void push(ReqHandle *handle) {
-            *(qr++) = handle;
-            if (qr > req_handles + sz) {
-                qr = req_handles;
-            }
-        }
-    };
-    RingBuffer<ReqHandle *, Context::kQueueDepth * 4> req_handle_free_queue;
-
-    // Common.
-    ibv_wc wcs[Context::kQueueDepth];
-    RpcContext *ctx;
-    void *context;
-    MsgBufPair conn_buf;
-    std::mutex conn_buf_mtx;
-
-    // shm.
-    ShmRpcRing *shm_ring;
-    uint64_t shm_ticket;
-    MsgBufPair *shm_bufs;
-    inline std::string shm_key(const std::string &ip, int port, int qp_id) {
-        return "shm-rpc" + ip + ":" + std::to_string(port) + ":" + std::to_string(qp_id);
-    }
-    static constexpr int kRingElemCnt = 8192;
+// Receive buffer of an RC client session, the wr_id of its receive.
+// A session posts Context::kQueueDepth of them at connect, each request claims one credit, and a buffer goes back
+// to its own QP once the response in it is released, so a response never lands in a buffer someone still reads.
+struct RCRecvBuf {
+    MsgBuf *buf;
+    QPCnt *qp;
 };
 
-struct RpcSession {
-    void send(uint8_t rpc_id, MsgBufPair *buf);
-    bool recv(MsgBufPair *msg, size_t retry_times = UINT64_MAX);
-    void handleQPResponses();
-    void handleSHMResponses();
-    Rpc *rpc;
-    QPCnt qp;
-    int rmt_qp_id;
-
-    // shm.
-    ShmRpcRing *shm_ring;
-    // don't batch too much...
-    std::vector<std::pair<ShmRpcRingSlot *, MsgBufPair *>> tickets;
+inline void rcPostRecv(RCRecvBuf *rx) {
+    rx->qp->qp->recv((uint64_t)&rx->buf->rpc_hdr, kMTU, rx->buf->lkey, (uint64_t)rx);
+}
+
+// RDMA write ring transport.
+// Each ring session owns, on both sides, a ring of kRingSlots MsgBufs that the peer fills with RDMA writes:
+// the client writes request i into the server's slot i, the server writes its response into the client's slot i.
+// Receivers poll memory, so no recv WR is posted. A message is
+// [RingMsgHdr][RpcHeader][payload][canary], it lives in a MsgBuf with the RingMsgHdr in the tail of hdr,
+// and is complete when both hdr.valid and the canary after the payload are set.
+// A message over kRingMaxMsgSize leaves no room for its canary, it goes by send/recv on the same QP instead:
+// the client keeps a receive posted per slot, and tracks ring requests by seq like RC ones.
+constexpr int kRingSlots = 64;
+constexpr uint64_t kRingCanary = 0x52494e4743414e59ull;
+constexpr int kMaxRingSessions = 256;
+
+struct RingMsgHdr {
+    uint32_t size;
+    uint32_t valid;
 };
 
-struct ReqHandle {
-    Rpc *rpc;
-    MsgBufPair *buf;
+constexpr uint32_t kRingMaxMsgSize = sizeof(MsgBuf::buf) - sizeof(uint64_t);
+
+inline RingMsgHdr *ringHdr(MsgBuf *buf) {
+    return (RingMsgHdr *)((char *)&buf->rpc_hdr - sizeof(RingMsgHdr));
+}
+
+inline volatile uint64_t *ringCanary(MsgBuf *buf, uint32_t size) {
+    return (volatile uint64_t *)(buf->buf + ((size + 7) & ~7u));
+}
+
+// Bytes to write for a message of size.
+inline uint32_t ringMsgLen(uint32_t size) {
+    return sizeof(RingMsgHdr) + sizeof(RpcHeader) + ((size + 7) & ~7u) + sizeof(uint64_t);
+}
+
+// Remote address of slot i of a ring.
+inline uint64_t ringSlotAddr(uint64_t ring_addr, uint64_t i) {
+    return ring_addr + (i % kRingSlots) * sizeof(MsgBuf) + offsetof(MsgBuf, rpc_hdr) - sizeof(RingMsgHdr);
+}
+
+// Fill the ring header and the canary of buf before writing it, at most kRingMaxMsgSize bytes.
+inline void ringFormat(MsgBuf *buf) {
+    assert(buf->size <= kRingMaxMsgSize);
+    *ringHdr(buf) = RingMsgHdr{ buf->size, 1 };
+    *ringCanary(buf, buf->size) = kRingCanary;
+}
+
+// Check whether a message has landed in slot, fill slot->size and reset the markers if so.
+inline bool ringPoll(MsgBuf *slot) {
+    volatile RingMsgHdr *hdr = ringHdr(slot);
+    if (hdr->valid == 0) return false;
+    uint32_t size = hdr->size;
+    if (*ringCanary(slot, size) != kRingCanary) return false;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    slot->size = size;
+    hdr->valid = 0;
+    *ringCanary(slot, size) = 0;
+    return true;
+}
+
+struct RingSession {
+    RingSession(RpcContext *rpc_ctx, bool is_server);
+
     QPCnt *qp;
-    enum { kQP, kSHM } type;
-    void response();
+    MsgBuf *ring;  // written by the peer.
+    ibv_mr *ring_mr;
+    uint64_t rmt_addr;  // ring of the peer.
+    uint32_t rmt_rkey;
+    uint64_t head;  // server: next slot to poll; client: next slot to fill.
+    uint64_t tail;  // client: oldest slot in flight.
+
+    // server.
+    MsgBuf *resp_bufs;  // response staging, one per slot.
+    MsgBufPair *pairs;
+
+    // client.
+    MsgBufPair *inflight[kRingSlots];
+    uint64_t seqs[kRingSlots];  // of the request in each slot.
 };
 
 }  // namespace rdma
@@ -2,49 +2,257 @@
 #define RDMA_RPC_RPC_H_
 
 #include <queue>
+#include <thread>
 #include <unordered_map>
 
 #include "rdma/context.h"
 #include "rdma/qp.h"
 #include "rdma/rpc/common.h"
+#include "rdma/rpc/rc_rpc.h"
 #include "rdma/rpc/shm.h"
+#include "rdma/rpc/stream.h"
+#include "utils/work_stealing.h"
 
 namespace rdma {
 
+// Handle of an in-flight request, the state lives in its MsgBufPair.
+struct RpcFuture {
+    // false when the request could not be sent.
+    inline bool valid() {
+        return buf != nullptr;
+    }
+    inline bool ready() {
+        return buf->finished.load(std::memory_order_acquire);
+    }
+    // Polls until the response arrives, nullptr on timeout or when the request was not sent.
+    inline MsgBuf *get(size_t retry_times = UINT64_MAX);
+    // Done with the response, see Rpc::releaseResponse.
+    inline void release();
+
+    Rpc *rpc;
+    MsgBufPair *buf;
+};
+
+// Outstanding requests of a shm session, by lane ticket in [head, tail).
+// The server takes a lane in order, so polling checks the oldest ones. Dispatched requests may complete out of order:
+// after kStallPolls polls on a stuck head the next 64 are checked too, and the completed ones are marked in done.
+struct ShmPending {
+    static constexpr int kStallPolls = 64;
+
+    // A lane used before goes on from its ticket.
+    ShmPending(ShmRpcRing *ring, int lane)
+        : ring(ring), lane(lane), n(ring->n_), bufs(n), done((n + 63) / 64), head(ring->lanes[lane].ticket_),
+          tail(head) {}
+
+    inline bool isDone(uint64_t ticket) {
+        return done[ticket % n / 64] >> (ticket % n % 64) & 1;
+    }
+    inline void flipDone(uint64_t ticket) {
+        done[ticket % n / 64] ^= 1ull << (ticket % n % 64);
+    }
+
+    ShmRpcRing *ring;
+    int lane;
+    uint64_t n;  // lane descriptors, the most requests in flight.
+    std::vector<MsgBufPair *> bufs;
+    std::vector<uint64_t> done;
+    uint64_t head{};
+    uint64_t tail{};
+    int stalled{};
+};
+
+// Transport of a session, chosen at connect time.
+// kAuto: in-process for a server Rpc of this process, shm for a local peer, RC (or the write ring for small messages)
+// for the first Rpc::kAutoRCSessions remote sessions of an Rpc, UD beyond that.
+enum class RpcTransport {
+    kAuto,
+    kUD,
+    kRC,    // RC send/recv.
+    kRing,  // RC with RDMA writes into a polled ring.
+    kSHM,
+    kLocal,  // same process, see LocalChannel.
+};
+
+// Receive buffers posted as group_cnt chained groups of group_size WRs.
+// A group is reposted (one doorbell) once every buffer in it has been released,
+// so up to buf_cnt - group_size messages can arrive between two polls.
+// With an SRQ, the pool is shared by all the Rpcs of a RpcContext.
+// ud = false posts the buffers for RC QPs, which receive no GRH.
+struct RecvPool {
+    RecvPool(RpcContext *rpc_ctx, int buf_cnt, int group_cnt, bool use_srq, bool ud = true);
+
+    void postGroup(int group);
+    void postAll();
+
+    // Called after the message in pair is consumed.
+    inline void release(MsgBufPair *pair) {
+        int group = (pair - bufs) / group_size;
+        if (srq != nullptr) {
+            if (done[group].fetch_add(1, std::memory_order_acq_rel) + 1 < group_size) return;
+        } else {
+            int cur = done[group].load(std::memory_order_relaxed) + 1;
+            done[group].store(cur, std::memory_order_relaxed);
+            if (cur < group_size) return;
+        }
+        done[group].store(0, std::memory_order_relaxed);
+        postGroup(group);
+    }
+
+    int buf_cnt;
+    int group_cnt;
+    int group_size;
+    MsgBufPair *bufs;
+    ibv_sge *sges;
+    ibv_recv_wr *wrs;
+    std::atomic<int> *done;  // released buffers per group.
+    ibv_srq *srq{};
+    ibv_qp *qp{};  // owner QP when srq is not used.
+};
+
 // Single thread without coroutine.
 // Out-of-order response is supported.
+// Every Rpc serves UD, RC, write ring and shm sessions, the client picks one per session.
 struct Rpc {
-    Rpc(RpcContext *rpc_ctx, void *context, int qp_id);
+    // recv_buf_cnt and recv_group_cnt configure the receive refill, shared_recv backs
+    // every Rpc of rpc_ctx with one SRQ (the first Rpc created decides its size).
+    Rpc(RpcContext *rpc_ctx, void *context, int qp_id, int recv_buf_cnt = kSrvBufCnt,
+        int recv_group_cnt = kRecvWrGroupCnt, bool shared_recv = false);
+    // A server leaves the in-process registry, its in-process clients must be disconnected first.
+    ~Rpc();
 
     // Client API.
-    // Sync connect.
-    RpcSession connect(const std::string &ctx_ip, int ctx_port, int qp_id);
+    // Sync connect. msg_size_hint is the usual request size, 0 if unknown, it only steers kAuto.
+    // The session is not valid() when it can't be set up, e.g. the server refused it.
+    RpcSession connect(const std::string &ctx_ip, int ctx_port, int qp_id,
+                       RpcTransport transport = RpcTransport::kAuto, uint32_t msg_size_hint = 0);
+    RpcTransport pickTransport(const std::string &ctx_ip, uint32_t msg_size_hint);
+    // Waits for the requests of session and gives back what it holds on the server side, its shm lane,
+    // in-process channel or RC QP (and ring). Responses of an RC or ring session must be released first.
+    // The session is not valid() afterwards.
+    void disconnect(RpcSession *session);
+    // Sync connect to a RpcEndpoint, requests are spread over its workers per session or per request.
+    RpcSession connectEndpoint(const std::string &ctx_ip, int ctx_port, int ep_qp_id, bool per_request = false);
+
+    // false when the request was refused: a shm request larger than its lane allows, nothing was sent.
+    bool send(RpcSession *session, uint8_t rpc_id, MsgBufPair *buf);
+    // Async API, completed by poll(). buf must stay untouched until then.
+    inline RpcFuture sendAsync(RpcSession *session, uint8_t rpc_id, MsgBufPair *buf) {
+        if (!send(session, rpc_id, buf)) return RpcFuture{ this, nullptr };
+        return RpcFuture{ this, buf };
+    }
+    // cb(buf, arg) runs inside poll() when the response arrives.
+    inline bool sendAsync(RpcSession *session, uint8_t rpc_id, MsgBufPair *buf, void (*cb)(MsgBufPair *, void *),
+                          void *arg) {
+        buf->callback = cb;
+        buf->callback_arg = arg;
+        if (send(session, rpc_id, buf)) return true;
+        buf->callback = nullptr;
+        return false;
+    }
+
+    // Zero-copy shm requests, the pair points into the ring arena itself:
+    //   MsgBufPair *buf = rpc.reserveSHM(&session, req_cap);  // build the request in buf->send_buf
+    //   rpc.sendSHM(buf, rpc_id);
+    //   rpc.recv(buf);                               // read the response in buf->recv_buf
+    //   rpc.releaseSHM(buf);
+    // The slot and its arena room stay busy until released, don't hold a lane's worth of them.
+    // nullptr when the caps don't fit a lane.
+    MsgBufPair *reserveSHM(RpcSession *session, uint32_t req_cap, uint32_t resp_cap = ShmRpcRing::kMaxMsgSize);
+    void sendSHM(MsgBufPair *buf, uint8_t rpc_id);
+    void releaseSHM(MsgBufPair *buf);
+
+    // Coroutine mode (see rpc/coro_rpc.h): recv() hands the wait over to hook, which gives up after retry_times
+    // polls like recv() does, and returns kWaitUnhandled when it can't suspend the caller.
+    enum WaitResult { kWaitUnhandled, kWaitDone, kWaitTimeout };
+    using WaitHook = WaitResult (*)(MsgBufPair *, size_t retry_times, void *);
+    inline void setWaitHook(WaitHook hook, void *arg) {
+        wait_hook = hook;
+        wait_hook_arg = arg;
+    }
+    WaitHook wait_hook{};
+    void *wait_hook_arg{};
 
-    void send(RpcSession *session, uint8_t rpc_id, MsgBufPair *buf);
+    // UD, RC and ring responses are read in place, in a receive buffer or ring slot: recv_buf stays valid until
+    // the pair is sent again or releaseResponse() is called. Responses of a callback are released when it returns,
+    // unless it set keep_response. Buffers held that way are not reposted and a held ring slot keeps its credit,
+    // so don't sit on a recv group's worth of them.
+    inline void releaseResponse(MsgBufPair *buf);
+    void completeResponse(MsgBufPair *buf);
 
-    void handleSHMResponses(RpcSession *session);
+    // Progress every session: completes the MsgBufPairs whose responses arrived and serves requests.
+    void poll();
+    void handleSHMResponses();
     bool tryRecv(MsgBufPair *msg);
-    void recv(MsgBufPair *msg, size_t retry_times = UINT64_MAX);
+    bool recv(MsgBufPair *msg, size_t retry_times = UINT64_MAX);
+
+    // Fan-out: sends the request in payload to every session, bufs[i] gets the response of sessions[i].
+    // The UD requests go out in one doorbell, UD and RC requests gather the payload from the shared buffer,
+    // ring and shm requests get a copy in bufs[i]->send_buf.
+    void multicast(RpcSession **sessions, int k, uint8_t rpc_id, MsgBuf *payload, MsgBufPair **bufs);
+    // Waits until quorum of bufs have their response (k: all, 1: any), false on timeout.
+    // finished is left set on the completed bufs, the others are cancelled so they can be sent again.
+    bool gather(MsgBufPair **bufs, int k, int quorum, size_t retry_times = UINT64_MAX);
+    // Gives up on the response of the request in buf, which is dropped when it arrives. Not for in-process
+    // requests, which run on the pair itself, nor for reserveSHM pairs.
+    void cancel(MsgBufPair *buf);
+
+    // Streaming (stream.cpp), UD and RC sessions only. The chunks answering the request in buf
+    // are read with RpcStream::next(), closeStream() also cancels an unfinished stream.
+    RpcStream *openStream(RpcSession *session, uint8_t rpc_id, MsgBufPair *buf);
+    void closeStream(RpcStream *stream);
+    void sendStreamAck(RpcStream *stream, uint32_t consumed);
+    void onStreamChunk(MsgBuf *rbuf);
+    void startStream(const ReqHandle &handle);
+    void onStreamAck(MsgBuf *rbuf);
+    void pumpStreams();
+    std::vector<RpcStream *> free_streams{};
+    // Cancelled RC streams whose chunks are still coming: seq and session, whose credits are held until the
+    // final chunk arrives.
+    std::vector<std::pair<uint64_t, QPCnt *>> closing_streams{};
+    std::vector<ServerStream *> srv_streams{};
+    int active_streams{};
 
     void runEventLoopOnce();
 
-    void handleQP();
+    int handleQP();
 
     // Server API.
+    // With idle_park_us set, parks on the shm ring after kIdleSpinRounds empty rounds.
     void runServerLoopOnce();
-    void handleSHMRequests();
-    void postNextGroupRecv();
+    void idleWait();
+    static constexpr uint64_t kIdleSpinRounds = 1 << 16;
+    // Opt-in, for servers of shm and in-process sessions only: UD, RC and ring requests can't wake a parked server,
+    // they wait up to the timeout. 0, the default, never parks.
+    int64_t idle_park_us{ 0 };
+    uint64_t idle_rounds{};
+    // Request handlers return how many requests they took.
+    int handleSHMRequests();
+    int handleLocalRequests();
+    void handleSHMRequest(ShmRpcRingSlot *slot, uint64_t idx);
+    // payload != nullptr sends only the header of sbuf followed by the payload.
+    // owner is the server pair that holds sbuf, it is released when the send completes.
+    void stageSend(MsgBuf *sbuf, ibv_ah *ah, uint32_t qpn, MsgBuf *payload = nullptr, MsgBufPair *owner = nullptr);
+    void flushResponses();
+    void releaseServerPair(MsgBufPair *pair);
+
+    // Dispatch mode: handlers registered with dispatch = true run in n_workers NUMA-local threads,
+    // their responses come back through per-worker SPSC queues and are posted by the poller.
+    // Requests of RC and write ring sessions always run inline.
+    void enableDispatch(int n_workers, int numa = 0);
+    void drainDispatched();
+    static constexpr uint64_t kDispatchQueueSize = 16384;  // >= in-flight requests (recv bufs + shm slots).
+    WorkStealingPool<ReqHandle *> *dispatcher{};
+    std::vector<SPSCQueue<ReqHandle *> *> dispatch_done{};
+    // Dispatched UD requests are copied to a pair of their own, so a slow handler pins no receive buffer.
+    ReqHandle *qp_handles{};         // one per dispatch pair.
+    MsgBufPair *dispatch_pairs{};    // as many as recv pool buffers.
+    std::vector<int> free_dispatch;  // indices of free dispatch pairs, poller only.
+    ReqHandle *shm_handles{};  // one per shm slot.
     static constexpr int kSrvBufCnt = Context::kQueueDepth;
 
-    MsgBufPair *srv_bufs;
-    MsgBuf **srv_shm_bufs;
-    int srv_shm_buf_idx;
+    RecvPool *recv_pool;
     static constexpr int kRecvWrGroupCnt = 2;
     static constexpr int kRecvWrGroupSize = kSrvBufCnt / kRecvWrGroupCnt;
-    ibv_sge *srv_recv_sges;
-    ibv_recv_wr *srv_recv_wrs;
-    ibv_recv_wr *srv_recv_wr_hdrs[kRecvWrGroupCnt];
-    int cur_group;
 
     template<class T, size_t sz>
     struct RingBuffer {
@@ -75,45 +283,214 @@ struct Rpc {
     // Note: RpcIdentifier's id should be 0.
     std::unordered_map<RpcIdentifier, std::pair<ibv_ah *, uint32_t>, RpcIdentifierHash> id_ah_map;
 
+    // Send queue accounting, shared by requests and responses.
+    // A signaled WR carries in wr_id the number of WRs it retires.
+    void reserveSendQueue(int n);
+    void pollSendQueue();
+    int sq_inflight{};    // posted WRs not yet retired by a signaled completion.
+    int sq_unsignaled{};  // WRs posted since the last signaled one.
+    // Server pair of each posted WR, in post order from sq_head (nullptr for requests and stream chunks).
+    // The NIC reads send_buf until the WR is retired, so the pair is released only then.
+    MsgBufPair *sq_pairs[Context::kQueueDepth]{};
+    int sq_head{};
+    int sq_held{};        // non-null entries of sq_pairs.
+    uint64_t staged_pairs{};  // responses staged with an owner so far.
+
+    // Doorbell batching: responses of one loop iteration, or the requests of a multicast,
+    // are posted as one linked WR chain.
+    static constexpr int kMaxRespBatch = kRecvWrGroupSize;
+    ibv_send_wr resp_wrs[kMaxRespBatch];
+    ibv_sge resp_sges[kMaxRespBatch][2];
+    MsgBufPair *resp_owners[kMaxRespBatch];
+    int resp_cnt{};
+    int resp_held{};  // staged WRs with an owner.
+
     // Common.
     RpcIdentifier identifier;
     QP qp;
-    int send_cnt{};
-    int recv_cnt{};
     RpcContext *ctx{};
     void *context{};
     MsgBufPair conn_buf;
     std::mutex conn_buf_mtx;
 
     // rpc.
-    std::unordered_map<uint64_t, MsgBufPair *> seq_buf_map{};  // on fly seq -> MsgBufPair
-    uint64_t seq{};                                            // current sequence (per session).
+    // On fly seq -> MsgBufPair, direct-mapped so that sending allocates nothing.
+    static constexpr int kMaxInflight = 4096;  // power of 2.
+    inline void trackSeq(uint64_t seq, MsgBufPair *buf) {
+        MsgBufPair *&slot = seq_bufs[seq & (kMaxInflight - 1)];
+        if (unlikely(slot != nullptr)) {
+            LOG(ERROR) << "More than " << kMaxInflight << " requests in flight";
+        }
+        slot = buf;
+    }
+    inline MsgBufPair *untrackSeq(uint64_t seq) {
+        MsgBufPair *&slot = seq_bufs[seq & (kMaxInflight - 1)];
+        MsgBufPair *buf = slot;
+        slot = nullptr;
+        return buf;
+    }
+    // Pair waiting for the response seq, nullptr for a late one: its request was cancelled, or the pair sent again.
+    inline MsgBufPair *untrackResponse(uint64_t seq) {
+        MsgBufPair *&slot = seq_bufs[seq & (kMaxInflight - 1)];
+        MsgBufPair *buf = slot;
+        if (unlikely(buf == nullptr)) return nullptr;
+        if (unlikely(buf->send_buf->rpc_hdr.seq != seq)) {
+            // The slot belongs to the new request only if its seq maps here too.
+            if ((buf->send_buf->rpc_hdr.seq ^ seq) & (kMaxInflight - 1)) slot = nullptr;
+            return nullptr;
+        }
+        slot = nullptr;
+        return buf;
+    }
+    std::vector<MsgBufPair *> seq_bufs = std::vector<MsgBufPair *>(kMaxInflight, nullptr);
+    uint64_t seq{};  // current sequence (per session).
+    uint64_t session_cnt{};                                    // picks the worker of endpoint sessions.
 
     // shm.
     ShmRpcRing *shm_ring{};
-    uint64_t shm_ticket{};
+    uint64_t shm_tickets_srv[ShmRpcRing::kMaxLanes]{};  // next request of every client lane.
     MsgBufPair *shm_bufs{};
-    inline std::string shm_key(const std::string &ip, int port, int qp_id) {
+    std::vector<MsgBuf *> shm_scratch{};  // responses of requests that left less room than a MsgBuf, per slot.
+    // Requests in flight, one per shm session.
+    std::vector<ShmPending *> shm_pendings{};
+    inline void trackSHM(RpcSession *session, uint64_t ticket, MsgBufPair *buf);
+    bool completeSHM(ShmPending *p, uint64_t ticket);
+    std::vector<MsgBufPair *> free_shm_pairs{};  // for reserveSHM.
+
+    // In-process sessions (local_rpc.cpp).
+    static Rpc *findLocal(const std::string &ip, int port, int qp_id);
+    void registerLocal();
+    void unregisterLocal();
+    bool connectLocal(RpcSession *session, Rpc *server);
+    void disconnectLocal(RpcSession *session);
+    void sendLocal(RpcSession *session, MsgBufPair *buf);
+    void handleLocalResponses();
+    void serveLocal(LocalChannel *ch, MsgBufPair *buf);
+    // Server: in-process requests are served in the client's send() rather than by the next poll of this Rpc.
+    // Only when every in-process client runs on the thread that polls this Rpc, e.g. a client and a server that
+    // share a thread, which would never poll the server while the client waits.
+    bool local_inline{};
+    static constexpr int kMaxLocalSessions = 256;
+    LocalChannel *local_chs[kMaxLocalSessions]{};  // server side.
+    std::atomic<int> local_ch_cnt{};
+    std::vector<LocalChannel *> local_sessions{};  // client side.
+    static inline std::string shm_key(const std::string &ip, int port, int qp_id) {
         return "shm-rpc" + ip + ":" + std::to_string(port) + ":" + std::to_string(qp_id);
     }
-    static constexpr int kRingElemCnt = 8192;
+    static constexpr int kRingElemCnt = 8192;         // shm descriptors.
+    static constexpr uint64_t kShmArenaSize = 8 << 20;  // shm messages, 128KB per client lane.
+    static constexpr int kShmPrefaultThreads = 4;       // the ring is on huge pages when there are free ones.
+
+    // RC transports (rc_rpc.cpp).
+    static constexpr int kAutoRCSessions = 8;
+    static constexpr uint32_t kAutoRingMaxSize = 512;  // kAuto uses the ring up to this size hint.
+    bool connectRC(RpcSession *session, const std::string &ctx_ip, int ctx_port, int qp_id);
+    void disconnectRC(RpcSession *session);
+    void sendRC(RpcSession *session, MsgBufPair *buf, MsgBuf *payload = nullptr);
+    void sendRing(RpcSession *session, MsgBufPair *buf);
+    void handleRCResponses();
+    void freeRingSlot(QPCnt *qp, uint64_t seq);
+    void bindRC(int qp_id);
+    void setupRCServer();
+    bool addRCQP(QPCnt *qp_cnt);
+    // Server side of disconnectRC(), by the poller once the QP has no signaled send left in the shared CQ.
+    void closeRCQPs();
+    inline QPCnt *findRCQP(uint32_t qpn) {
+        // Linear probing, a QP is always found since it is added before it connects.
+        for (uint32_t i = qpn & (kMaxRCQPs - 1);; i = (i + 1) & (kMaxRCQPs - 1)) {
+            QPCnt *qp_cnt = rc_qps[i].load(std::memory_order_acquire);
+            if (qp_cnt->qp->qp->qp_num == qpn) return qp_cnt;
+        }
+    }
+    int handleRCRequests();
+    int reserveRC(QPCnt *qp_cnt);
+    void pollRCSendCQ(ibv_cq *cq);
+    void postRCResponse(QPCnt *qp_cnt, MsgBuf *sbuf);
+    void postRingResponse(RingSession *ring, MsgBufPair *pair);
+    int rc_session_cnt{};  // remote RC and ring sessions of this client.
+
+    // RC client, each session receives in its own buffers (see RCRecvBuf).
+    // The QPs of every session share a send CQ and a recv CQ, grown with the sessions to hold every completion
+    // they can have outstanding.
+    ibv_cq *rc_cli_send_cq{}, *rc_cli_recv_cq{};
+    int rc_cli_recv_cnt{};  // receives posted by all the sessions.
+    std::vector<RingSession *> cli_rings{};
+
+    // RC server, set up by the first connection.
+    static constexpr int kRCSrvBufCnt = 1024;
+    RecvPool *rc_recv_pool{};
+    ibv_cq *rc_send_cq{}, *rc_recv_cq{};  // shared by every server RC QP, sized for kMaxRCQPs / 2 of them.
+    std::atomic<bool> rc_ready{};
+    std::mutex rc_mtx;
+    static constexpr int kMaxRCQPs = 4096;  // power of 2.
+    std::atomic<QPCnt *> rc_qps[kMaxRCQPs]{};  // open addressing on qpn.
+    int rc_qp_cnt{};
+    RingSession *ring_sessions[kMaxRingSessions]{};
+    std::atomic<int> ring_session_cnt{};  // published by the connect handler, under rc_mtx.
+    std::vector<QPCnt *> rc_closing{};    // disconnected by their client, under rc_mtx.
+    std::atomic<bool> rc_has_closing{};
+};
+
+inline std::string ep_key(int ep_qp_id) {
+    return "rpc_ep_" + std::to_string(ep_qp_id);
+}
+
+// One logical RPC service behind one address, served by n_workers threads.
+// Worker i owns an Rpc (UD QP and shm ring) with qp_id = ep_qp_id + i and runs its server loop,
+// clients learn the workers' QPNs at connectEndpoint time.
+struct RpcEndpoint {
+    // shared_recv puts the workers on one SRQ of n_workers * Rpc::kSrvBufCnt buffers.
+    // dispatch_workers > 0 gives each worker Rpc a dispatch pool of that size.
+    RpcEndpoint(RpcContext *rpc_ctx, void *context, int ep_qp_id, int n_workers, int numa = 0,
+                bool shared_recv = true, int dispatch_workers = 0);
+    ~RpcEndpoint();
+
+    void stop();
+
+    RpcContext *ctx;
+    int ep_qp_id;
+    int n_workers;
+    std::vector<Rpc *> rpcs;
+    std::vector<std::thread> workers;
+    std::atomic<int> ready{};
+    std::atomic<bool> running{};
 };
 
 struct RpcSession {
+    inline bool valid() {
+        return rpc != nullptr;
+    }
+
     inline RpcHeader rpcHeader(uint8_t rpc_id) {
         return RpcHeader{ .identifier = RpcIdentifier(rpc->identifier, rpc_id), .seq = rpc->seq++ };
     }
 
-    void send(uint8_t rpc_id, MsgBufPair *buf);
-    void recv(MsgBufPair *msg, size_t retry_times = UINT64_MAX);
+    bool send(uint8_t rpc_id, MsgBufPair *buf);
+    bool recv(MsgBufPair *msg, size_t retry_times = UINT64_MAX);
+    inline uint32_t destQPN(uint64_t seq) {
+        return per_request ? worker_qpns[seq % worker_qpns.size()] : qpn;
+    }
+
     Rpc *rpc{};
+    RpcTransport transport{ RpcTransport::kUD };
     ibv_ah *ah{};
     uint32_t qpn{};
 
+    // RC and ring.
+    QPCnt *qp{};
+    int rmt_qp_id{};
+    RingSession *ring{};
+
+    // endpoint.
+    bool per_request{};
+    std::vector<uint32_t> worker_qpns{};
+
     // shm.
     ShmRpcRing *shm_ring{};
-    // don't batch too much...
-    std::vector<std::pair<ShmRpcRingSlot *, MsgBufPair *>> tickets{};
+    int shm_lane{};
+    ShmPending *shm_pending{};
+    LocalChannel *local{};
+    uint32_t shm_resp_cap{ ShmRpcRing::kMaxMsgSize };  // room kept for the response of each copied request.
 };
 
 struct ReqHandle {
@@ -121,10 +498,91 @@ struct ReqHandle {
     MsgBufPair *buf{};
     ibv_ah *ah{};
     uint32_t src_qp{};
-    enum { kQP, kSHM } type{};
+    enum { kQP, kSHM, kRC, kRing, kLocal } type{};
+    uint8_t rpc_id{};
+    int worker{ -1 };  // dispatch worker running the handler, -1 for inline.
+    QPCnt *rc_qp{};
+    RingSession *ring{};
+    LocalChannel *local{};
     void response();
 };
 
+// In-process session to a server Rpc of this process, no copies: the handler reads the client's send_buf
+// and writes the client's recv_buf (the pair's buffers are swapped while it runs).
+// Requests go through an SPSC queue, or straight to the handler with Rpc::local_inline, the server flags the slot
+// of a request when it responded.
+struct LocalChannel {
+    static constexpr int kDepth = 256;  // requests in flight.
+
+    LocalChannel(Rpc *server) : server(server), reqs(kDepth) {}
+
+    Rpc *server;
+    bool in_use{};  // has a client session, under the lock of the server registry.
+    SPSCQueue<MsgBufPair *> reqs;
+    std::atomic<bool> done[kDepth]{};
+    ReqHandle handles[kDepth];  // server side, by request ticket.
+    // Client side, requests [head, tail) are in flight.
+    alignas(hardware_destructive_interference_size) MsgBufPair *sent[kDepth];
+    uint64_t head{};
+    uint64_t tail{};
+};
+
+inline void Rpc::trackSHM(RpcSession *session, uint64_t ticket, MsgBufPair *buf) {
+    // Tickets of a lane are consecutive.
+    ShmPending *p = session->shm_pending;
+    p->bufs[ticket % p->n] = buf;
+    p->tail = ticket + 1;
+}
+
+inline MsgBuf *RpcFuture::get(size_t retry_times) {
+    if (unlikely(!valid())) return nullptr;
+    return rpc->recv(buf, retry_times) ? buf->recv_buf : nullptr;
+}
+
+inline void RpcFuture::release() {
+    if (valid()) rpc->releaseResponse(buf);
+}
+
+inline void Rpc::releaseResponse(MsgBufPair *buf) {
+    if (buf->rx_pair != nullptr) {
+        buf->rx_pool->release(buf->rx_pair);
+        buf->rx_pair = nullptr;
+    }
+    if (buf->rx_rc != nullptr) {
+        rcPostRecv(buf->rx_rc);
+        ++buf->rx_rc->qp->credits;
+        buf->rx_rc = nullptr;
+    }
+    if (buf->rx_ring != nullptr) {
+        buf->rx_ring->inflight[buf->recv_buf - buf->rx_ring->ring] = nullptr;
+        ++buf->rx_ring->qp->credits;
+        buf->rx_ring = nullptr;
+    }
+}
+
+// Waits for every future, e.g. the replies of a fan-out. Returns false on timeout, or once the valid futures
+// are all done when some request could not be sent.
+inline bool whenAll(RpcFuture *futures, size_t n, size_t retry_times = UINT64_MAX) {
+    size_t done = 0;
+    for (size_t i = 0; i < retry_times && done < n; ++i) {
+        // Futures complete out of order, but the first pending one gives the Rpc to poll.
+        while (done < n && (!futures[done].valid() || futures[done].ready())) {
+            ++done;
+        }
+        if (done < n) futures[done].rpc->poll();
+    }
+    if (done < n) return false;
+    bool all_sent = true;
+    for (size_t i = 0; i < n; ++i) {
+        if (!futures[i].valid()) {
+            all_sent = false;
+            continue;
+        }
+        futures[i].buf->finished.store(false, std::memory_order_relaxed);
+    }
+    return all_sent;
+}
+
 }  // namespace rdma
 
 #endif  // RDMA_RPC_RPC_H_
\ No newline at end of file
@@ -2,131 +2,498 @@
 #define RDMA_RPC_SHM_H_
 
 #include <fcntl.h>
+#include <linux/futex.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
+#include <numa.h>
+
+#include <algorithm>
 #include <atomic>
+#include <climits>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "rdma/rpc/common.h"
+#include "utils/trace.h"
 
 namespace rdma {
 
+// Backing of a ring, set by the server at create. Clients find the huge page file if there is one.
+struct ShmRingOptions {
+    bool huge_pages = false;   // hugetlbfs file in kHugePageDir, falls back to shm_open.
+    int numa = -1;             // binds the pages to this node.
+    int prefault_threads = 0;  // touch every page at create, in parallel.
+};
+
+constexpr const char *kHugePageDir = "/dev/hugepages";
+constexpr uint64_t kHugePageSize = 2 << 20;
+
+// Spin-then-park waiting across processes. A waiter spins kSpinRounds with pause, then sleeps on a futex in
+// the shared segment. The peer only makes the wake syscall when sleepers is set, so the busy path stays a load.
+struct alignas(kCacheLineSize) ShmWaker {
+    static constexpr int kSpinRounds = 4096;
+
+    // timeout_us < 0: until ready.
+    template<class Pred>
+    inline bool wait(Pred ready, int64_t timeout_us = -1) {
+        for (int i = 0; i < kSpinRounds; ++i) {
+            if (ready()) return true;
+            asm volatile("pause" ::: "memory");
+        }
+        timespec ts{ timeout_us / 1000000, timeout_us % 1000000 * 1000 };
+        while (!ready()) {
+            uint32_t cur = seq()->load(std::memory_order_acquire);
+            // seq_cst pairs with wake(): either the waker sees the sleeper or the sleeper sees the data.
+            sleepers()->fetch_add(1, std::memory_order_seq_cst);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            bool got = ready();
+            if (!got) {
+                syscall(SYS_futex, &seq_, FUTEX_WAIT, cur, timeout_us < 0 ? nullptr : &ts, nullptr, 0);
+                got = ready();
+            }
+            sleepers()->fetch_sub(1, std::memory_order_relaxed);
+            if (got) return true;
+            if (timeout_us >= 0) return false;
+        }
+        return true;
+    }
+
+    // After publishing with a seq_cst store or RMW.
+    inline void wake() {
+        if (likely(sleepers()->load(std::memory_order_seq_cst) == 0)) return;
+        seq()->fetch_add(1, std::memory_order_release);
+        syscall(SYS_futex, &seq_, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+
+    inline std::atomic<uint32_t> *seq() {
+        return reinterpret_cast<std::atomic<uint32_t> *>(&seq_);
+    }
+    inline std::atomic<uint32_t> *sleepers() {
+        return reinterpret_cast<std::atomic<uint32_t> *>(&sleepers_);
+    }
+
+    uint32_t seq_;
+    uint32_t sleepers_;
+};
+
+// A request descriptor, its messages live in the lane's arena.
+struct alignas(kCacheLineSize) ShmRpcRingSlot {
+    uint64_t turn_;
+    bool finished_;
+    uint8_t rpc_id;
+    // For cache friendliness, don't use the sizes in the MsgBufs.
+    uint32_t req_size;
+    uint32_t resp_size;
+    uint32_t resp_cap;
+    // MsgBufs of the request and the response, offsets from the start of the ring.
+    uint64_t req_off;
+    uint64_t resp_off;
+    uint64_t arena_end;  // client only: end of the messages in its arena stream.
+
+    std::atomic<uint64_t> *turn() {
+        return reinterpret_cast<std::atomic<uint64_t> *>(&turn_);
+    }
+    std::atomic<bool> *finished() {
+        return reinterpret_cast<std::atomic<bool> *>(&finished_);
+    }
+};
+
+// Owned by one client, only its thread touches it.
+struct alignas(kCacheLineSize) ShmRpcLane {
+    uint64_t ticket_;       // next request.
+    uint64_t free_ticket_;  // oldest request whose messages still hold arena space.
+    // Arena stream positions, [tail_, head_) is in use.
+    uint64_t head_;
+    uint64_t tail_;
+};
+
 // Don't overlap!
+// The descriptors and the payload arena are split into kMaxLanes single-producer lanes. Each client registers its
+// own lane right after open(), so clients never share a cache line, and the server sweeps the registered lanes.
+// A lane is given back once its requests are released, the next client continues from its ticket.
+// A request takes a descriptor and a variable-length region of its lane's arena: the request MsgBuf followed by room
+// for resp_cap bytes of response. Regions are carved in order and don't wrap, the client frees them in order.
+// Descriptor protocol, lap t = lane ticket / n_: turn 3t free, 3t + 1 client writing, 3t + 2 request ready, the
+// server sets finished when the response is in, and the client releases the descriptor (3t + 3) once it read it.
+// The server doesn't trust what the client wrote in a descriptor: a handler only writes in place when the client
+// left room for any response in its own lane, else into a server buffer that is copied in if it fits the room.
+// What doesn't fit is not published, resp_size is kRespTooLarge and the client reads an empty response, which is
+// also the answer to a request the client put outside its lane.
+// Blocking waits park on srv_waker_ (requests) and lane_wakers_ (responses of a lane), see ShmWaker.
 struct alignas(kCacheLineSize) ShmRpcRing {
-    static ShmRpcRing *create(const std::string &name, uint64_t n) {
-        int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0666);
-        DLOG(INFO) << "shm_open " << name << " fd " << fd << " n " << n << " size "
-                   << sizeof(ShmRpcRing) + n * sizeof(ShmRpcRingSlot);
-        uint64_t size = sizeof(ShmRpcRing) + n * sizeof(ShmRpcRingSlot);
-        if (ftruncate(fd, size) == -1) {
-            LOG(FATAL) << "ftruncate for shm failed";
+    static constexpr int kMaxLanes = 64;
+    static constexpr uint64_t kBufHdrSize = sizeof(MsgBuf) - sizeof(MsgBuf::buf);
+    static constexpr uint32_t kMaxMsgSize = sizeof(MsgBuf::buf);
+    static constexpr uint32_t kRespTooLarge = UINT32_MAX;
+
+    static inline uint64_t mapSize(uint64_t n, uint64_t arena_size) {
+        return sizeof(ShmRpcRing) + n * sizeof(ShmRpcRingSlot) + arena_size;
+    }
+
+    // n descriptors and arena_size bytes of messages in total.
+    static ShmRpcRing *create(const std::string &name, uint64_t n, uint64_t arena_size,
+                              const ShmRingOptions &opts = ShmRingOptions()) {
+        uint64_t size = mapSize(n, arena_size);
+        void *ptr = nullptr;
+        uint64_t page = 4096;
+        if (opts.huge_pages) {
+            ptr = mapHuge(name, size, true);
+            page = kHugePageSize;
         }
-        void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-        memset(ptr, 0, size);
-        if (ptr == MAP_FAILED) {
-            LOG(FATAL) << "mmap for shm failed";
+        if (ptr == nullptr) {
+            unlink(hugePath(name).c_str());
+            ptr = mapShm(name, size, true);
+            page = 4096;
+        } else {
+            shm_unlink(name.c_str());
         }
-        close(fd);
+        if (opts.numa >= 0 && numa_available() >= 0) {
+            // Before the first touch, so every page lands on the server's node.
+            numa_tonode_memory(ptr, size, opts.numa);
+        }
+        if (opts.prefault_threads > 0) {
+            prefault(ptr, size, page, opts.prefault_threads);
+        }
+        // The arena is written before it's read.
+        memset(ptr, 0, size - arena_size);
         ShmRpcRing *ring = (ShmRpcRing *)ptr;
-        ring->ticket_ = 0;
-        ring->n_ = n;
+        ring->n_ = n / kMaxLanes;
+        ring->lane_cnt_ = 0;
+        ring->lane_used_ = 0;
+        ring->arena_off_ = size - arena_size;
+        ring->lane_arena_ = arena_size / kMaxLanes / kCacheLineSize * kCacheLineSize;
         return ring;
     }
 
-    static ShmRpcRing *open(const std::string &name, uint64_t n) {
-        int fd = shm_open(name.c_str(), O_RDWR, 0666);
-        DLOG(INFO) << "shm_open " << name << " fd " << fd << " n " << n << " size "
-                   << sizeof(ShmRpcRing) + n * sizeof(ShmRpcRingSlot);
-        uint64_t size = sizeof(ShmRpcRing) + n * sizeof(ShmRpcRingSlot);
-        void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-        if (ptr == MAP_FAILED) {
-            LOG(FATAL) << "mmap for shm failed";
+    static ShmRpcRing *open(const std::string &name, uint64_t n, uint64_t arena_size) {
+        uint64_t size = mapSize(n, arena_size);
+        void *ptr = mapHuge(name, size, false);
+        if (ptr == nullptr) {
+            ptr = mapShm(name, size, false);
         }
-        close(fd);
         return (ShmRpcRing *)ptr;
     }
 
-    inline std::atomic<uint64_t> *ticket() {
-        return reinterpret_cast<std::atomic<uint64_t> *>(&ticket_);
+    inline std::atomic<int> *laneCnt() {
+        return reinterpret_cast<std::atomic<int> *>(&lane_cnt_);
     }
 
-    inline uint64_t clientSend(uint8_t rpc_id, MsgBuf *send_buf) {
-        uint64_t cur = ticket()->fetch_add(1);
-        ShmRpcRingSlot *slot = &slots[idx(cur)];
-        uint64_t expected_turn = turn(cur) * 2;
-        while (slot->turn()->load(std::memory_order_acquire) != expected_turn) {}
-        slot->turn()->fetch_add(1, std::memory_order_release);
+    inline std::atomic<uint64_t> *laneUsed() {
+        return reinterpret_cast<std::atomic<uint64_t> *>(&lane_used_);
+    }
+
+    // A free lane for a client thread, -1 when all of them are taken.
+    inline int registerLane() {
+        static_assert(kMaxLanes == 64, "one bit of lane_used_ per lane");
+        uint64_t used = laneUsed()->load(std::memory_order_acquire);
+        int lane;
+        do {
+            if (used == ~0ull) return -1;
+            lane = __builtin_ctzll(~used);
+        } while (!laneUsed()->compare_exchange_weak(used, used | 1ull << lane, std::memory_order_acq_rel));
+        // The server sweeps [0, lane_cnt_).
+        int cnt = laneCnt()->load(std::memory_order_relaxed);
+        while (cnt <= lane && !laneCnt()->compare_exchange_weak(cnt, lane + 1, std::memory_order_release)) {
+        }
+        return lane;
+    }
+
+    // Once every request of the lane is released.
+    inline void unregisterLane(int lane) {
+        laneUsed()->fetch_and(~(1ull << lane), std::memory_order_release);
+    }
+
+    inline MsgBuf *reqBuf(ShmRpcRingSlot *slot) {
+        return (MsgBuf *)((char *)this + slot->req_off);
+    }
+
+    inline MsgBuf *respBuf(ShmRpcRingSlot *slot) {
+        return (MsgBuf *)((char *)this + slot->resp_off);
+    }
+
+    // Whether a request of req_cap bytes with room for resp_cap bytes of response can ever be reserved.
+    inline bool clientFits(uint32_t req_cap, uint32_t resp_cap) {
+        return req_cap <= kMaxMsgSize && resp_cap <= kMaxMsgSize &&
+               alignUp(kBufHdrSize + req_cap) + alignUp(kBufHdrSize + resp_cap) <= lane_arena_;
+    }
+
+    // Zero-copy client path: build the request (at most req_cap bytes) in reqBuf() of the reserved slot, commit it,
+    // read the response in place from respBuf() once clientTryPoll() says it's in, then release the slot.
+    // nullptr while the lane has no free descriptor or arena room, which only releases of this client make,
+    // and for good when !clientFits(), which callers check first.
+    inline ShmRpcRingSlot *clientTryReserve(int lane, uint32_t req_cap, uint32_t resp_cap, uint64_t *ticket) {
+        if (unlikely(!clientFits(req_cap, resp_cap))) return nullptr;
+        ShmRpcLane &l = lanes[lane];
+        uint64_t cur = l.ticket_;
+        ShmRpcRingSlot *slot = get(lane, cur);
+        uint64_t expected_turn = turn(cur) * 3;
+        if (slot->turn()->load(std::memory_order_acquire) != expected_turn) return nullptr;
+
+        uint64_t req_len = alignUp(kBufHdrSize + req_cap);
+        uint64_t len = req_len + alignUp(kBufHdrSize + resp_cap);
+        uint64_t start = l.head_;
+        if (start % lane_arena_ + len > lane_arena_) {
+            // Skip the end of the arena rather than split the messages.
+            start += lane_arena_ - start % lane_arena_;
+        }
+        if (start + len - l.tail_ > lane_arena_) return nullptr;
+
+        l.head_ = start + len;
+        ++l.ticket_;
+        slot->turn()->store(expected_turn + 1, std::memory_order_relaxed);
+        slot->req_off = arena_off_ + lane * lane_arena_ + start % lane_arena_;
+        slot->resp_off = slot->req_off + req_len;
+        slot->resp_cap = resp_cap;
+        slot->arena_end = l.head_;
+        *ticket = cur;
+        return slot;
+    }
+
+    inline void clientCommit(ShmRpcRingSlot *slot, uint8_t rpc_id) {
         slot->rpc_id = rpc_id;
-        slot->recv_buf_size = send_buf->size;
-        memcpy(slot->recv_buf.buf, send_buf->buf, send_buf->size);
+        slot->req_size = reqBuf(slot)->size;
+        TRACE(kTraceShmCommit, rpc_id, slot->req_size);
+        slot->turn()->fetch_add(1, std::memory_order_seq_cst);
+        srv_waker_.wake();
+    }
+
+    inline bool clientTryPoll(ShmRpcRingSlot *slot) {
+        return slot->finished()->load(std::memory_order_acquire);
+    }
+
+    inline void clientRelease(int lane, ShmRpcRingSlot *slot) {
+        slot->finished()->store(false, std::memory_order_relaxed);
         slot->turn()->fetch_add(1, std::memory_order_release);
+        // Give back the arena up to the oldest request still held.
+        ShmRpcLane &l = lanes[lane];
+        while (l.free_ticket_ < l.ticket_) {
+            ShmRpcRingSlot *s = get(lane, l.free_ticket_);
+            if (s->turn()->load(std::memory_order_relaxed) != turn(l.free_ticket_) * 3 + 3) break;
+            l.tail_ = s->arena_end;
+            ++l.free_ticket_;
+        }
+    }
+
+    // Copying client path.
+    inline ShmRpcRingSlot *clientTrySend(int lane, uint8_t rpc_id, MsgBuf *send_buf, uint32_t resp_cap,
+                                         uint64_t *ticket) {
+        ShmRpcRingSlot *slot = clientTryReserve(lane, send_buf->size, resp_cap, ticket);
+        if (slot == nullptr) return nullptr;
+        MsgBuf *req = reqBuf(slot);
+        req->size = send_buf->size;
+        memcpy(req->buf, send_buf->buf, send_buf->size);
+        clientCommit(slot, rpc_id);
+        return slot;
+    }
+
+    // Spins for room, so the client must not hold unreleased requests that fill its lane. clientFits() first.
+    inline uint64_t clientSend(int lane, uint8_t rpc_id, MsgBuf *send_buf, uint32_t resp_cap = kMaxMsgSize) {
+        assert(clientFits(send_buf->size, resp_cap));
+        uint64_t cur;
+        while (clientTrySend(lane, rpc_id, send_buf, resp_cap, &cur) == nullptr) {
+            asm volatile("pause" ::: "memory");
+        }
         return cur;
     }
 
-    inline void clientRecv(MsgBuf *recv_buf, uint64_t ticket) {
-        ShmRpcRingSlot *slot = &slots[idx(ticket)];
-        while (slot->finished()->load(std::memory_order_acquire) == false) {}
-        recv_buf->size = slot->send_buf_size;
-        memcpy(recv_buf->buf, slot->send_buf.buf, slot->send_buf_size);
-        slot->finished()->store(false, std::memory_order_release);
+    inline void clientRecv(int lane, MsgBuf *recv_buf, uint64_t ticket) {
+        ShmRpcRingSlot *slot = get(lane, ticket);
+        lane_wakers_[lane].wait([&]() { return clientTryPoll(slot); });
+        clientTryRecv(lane, recv_buf, slot);
     }
 
-    inline bool clientTryRecv(MsgBuf *recv_buf, ShmRpcRingSlot *slot) {
-        if (slot->finished()->load(std::memory_order_acquire) == false) {
+    inline bool clientTryRecv(int lane, MsgBuf *recv_buf, ShmRpcRingSlot *slot) {
+        if (!clientTryPoll(slot)) {
             return false;
         }
-        recv_buf->size = slot->send_buf_size;
-        memcpy(recv_buf->buf, slot->send_buf.buf, slot->send_buf_size);
-        slot->finished()->store(false, std::memory_order_release);
+        recv_buf->size = slot->resp_size == kRespTooLarge ? 0 : slot->resp_size;
+        memcpy(recv_buf->buf, respBuf(slot)->buf, recv_buf->size);
+        clientRelease(lane, slot);
         return true;
     }
 
-    inline void serverRecv(uint64_t ticket) {
-        uint64_t expected = 2 * turn(ticket) + 2;
-        ShmRpcRingSlot *slot = &slots[idx(ticket)];
-        while (slot->turn()->load(std::memory_order_acquire) != expected) {}
-        slot->recv_buf.size = slot->recv_buf_size;
+    inline void serverRecv(int lane, uint64_t ticket) {
+        srv_waker_.wait([&]() { return serverTryRecv(lane, ticket); });
     }
 
-    inline bool serverTryRecv(uint64_t ticket) {
-        uint64_t expected = 2 * turn(ticket) + 2;
-        ShmRpcRingSlot *slot = &slots[idx(ticket)];
+    // For requests that arrive outside the ring, after a seq_cst fence.
+    inline void serverWake() {
+        srv_waker_.wake();
+    }
+
+    // Parks the server until a request may be in or timeout_us passed, ready() checks the lanes.
+    template<class Pred>
+    inline bool serverWait(Pred ready, int64_t timeout_us) {
+        return srv_waker_.wait(ready, timeout_us);
+    }
+
+    inline bool serverTryRecv(int lane, uint64_t ticket) {
+        uint64_t expected = 3 * turn(ticket) + 2;
+        ShmRpcRingSlot *slot = get(lane, ticket);
         if (slot->turn()->load(std::memory_order_acquire) == expected) {
-            slot->recv_buf.size = slot->recv_buf_size;
+            TRACE(kTraceShmRecv, lane, ticket);
             return true;
         }
         return false;
     }
 
-    inline void serverSend(uint64_t ticket) {
-        ShmRpcRingSlot *slot = &slots[idx(ticket)];
-        slot->send_buf_size = slot->send_buf.size;
-        slot->finished()->store(true, std::memory_order_release);
+    // Request MsgBuf of request idx with its size, read once from what the client wrote.
+    // nullptr when the client put it outside its lane.
+    inline MsgBuf *serverReqBuf(uint64_t idx) {
+        volatile ShmRpcRingSlot *slot = &slots[idx];
+        uint64_t off = slot->req_off;
+        uint32_t size = slot->req_size;
+        uint64_t lane_begin = arena_off_ + idx / n_ * lane_arena_;
+        if (size > kMaxMsgSize || off < lane_begin || off + kBufHdrSize + size > lane_begin + lane_arena_) {
+            return nullptr;
+        }
+        MsgBuf *req = (MsgBuf *)((char *)this + off);
+        req->size = size;
+        return req;
     }
 
-    inline ShmRpcRingSlot *get(uint64_t ticket) {
-        return &slots[idx(ticket)];
+    // Response MsgBuf of request idx and its room, read once from what the client wrote.
+    // nullptr when the client put it outside its lane.
+    inline MsgBuf *serverRespBuf(uint64_t idx, uint32_t *room) {
+        volatile ShmRpcRingSlot *slot = &slots[idx];
+        uint64_t off = slot->resp_off;
+        uint32_t cap = slot->resp_cap;
+        uint64_t lane_begin = arena_off_ + idx / n_ * lane_arena_;
+        if (cap > kMaxMsgSize || off < lane_begin || off + kBufHdrSize + cap > lane_begin + lane_arena_) {
+            return nullptr;
+        }
+        *room = cap;
+        return (MsgBuf *)((char *)this + off);
     }
 
-    // Cache line state: shared (server & client both read n_)
-    uint64_t n_;
-    char pad[hardware_destructive_interference_size - sizeof(uint64_t)];
+    // idx: index of the slot in the whole ring, see slotIdx. resp is the response, in place (serverRespBuf() with
+    // room for any response) or in a server buffer that is copied in.
+    inline void serverSend(uint64_t idx, MsgBuf *resp) {
+        uint32_t room = 0;
+        MsgBuf *dst = serverRespBuf(idx, &room);
+        uint32_t size = resp->size;
+        if (unlikely(dst == nullptr || size > room)) {
+            LOG(ERROR) << "shm response of " << size << " bytes doesn't fit its room of " << room << " bytes";
+            size = kRespTooLarge;
+            if (dst != nullptr) dst->size = 0;
+        } else if (resp != dst) {
+            dst->size = size;
+            memcpy(dst->buf, resp->buf, size);
+        }
+        serverPublish(idx, size);
+    }
+
+    // Answers request idx with an empty response, without running a handler.
+    inline void serverReject(uint64_t idx) {
+        uint32_t room = 0;
+        MsgBuf *dst = serverRespBuf(idx, &room);
+        if (dst != nullptr) dst->size = 0;
+        serverPublish(idx, kRespTooLarge);
+    }
 
-    // Cache line state: exclusive (Ping-pong among clients)
-    uint64_t ticket_;
-    char pad2[hardware_destructive_interference_size - sizeof(uint64_t)];
+    inline void serverPublish(uint64_t idx, uint32_t size) {
+        slots[idx].resp_size = size;
+        TRACE(kTraceShmRespond, idx, size);
+        slots[idx].finished()->store(true, std::memory_order_seq_cst);
+        lane_wakers_[idx / n_].wake();
+    }
+
+    inline uint64_t slotIdx(int lane, uint64_t ticket) {
+        return lane * n_ + ticket % n_;
+    }
+
+    inline ShmRpcRingSlot *get(int lane, uint64_t ticket) {
+        return &slots[slotIdx(lane, ticket)];
+    }
+
+    inline ShmRpcRingSlot *get(uint64_t idx) {
+        return &slots[idx];
+    }
+
+    // Cache line state: shared (read only after create, but lane_cnt_ which the server polls and lane_used_ which
+    // clients change when they come and go)
+    uint64_t n_;  // descriptors per lane.
+    uint64_t arena_off_;
+    uint64_t lane_arena_;  // arena bytes per lane.
+    uint64_t lane_used_;   // bit per registered lane.
+    int lane_cnt_;         // lanes ever registered, up to the highest.
+    char pad[hardware_destructive_interference_size - 4 * sizeof(uint64_t) - sizeof(int)];
+
+    ShmRpcLane lanes[kMaxLanes];
+    ShmWaker srv_waker_;
+    ShmWaker lane_wakers_[kMaxLanes];
 
     ShmRpcRingSlot slots[];
 
 private:
-    inline uint64_t idx(uint64_t ticket) {
-        return ticket % n_;
+    static inline std::string hugePath(const std::string &name) {
+        return std::string(kHugePageDir) + "/" + name;
+    }
+
+    // nullptr when hugetlbfs isn't mounted, has no free pages or holds no such ring.
+    static void *mapHuge(const std::string &name, uint64_t size, bool create) {
+        std::string path = hugePath(name);
+        int fd = ::open(path.c_str(), create ? O_CREAT | O_RDWR : O_RDWR, 0666);
+        if (fd == -1) return nullptr;
+        size = (size + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+        void *ptr = nullptr;
+        if (!create || ftruncate(fd, size) == 0) {
+            ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (ptr == MAP_FAILED || ptr == nullptr) {
+            if (create) {
+                LOG(WARNING) << "No huge pages for shm ring " << name << ", using 4KB pages";
+                unlink(path.c_str());
+            }
+            return nullptr;
+        }
+        DLOG(INFO) << "hugetlbfs " << path << " size " << size;
+        return ptr;
+    }
+
+    static void *mapShm(const std::string &name, uint64_t size, bool create) {
+        int fd = shm_open(name.c_str(), create ? O_CREAT | O_RDWR : O_RDWR, 0666);
+        DLOG(INFO) << "shm_open " << name << " fd " << fd << " size " << size;
+        if (create && ftruncate(fd, size) == -1) {
+            LOG(FATAL) << "ftruncate for shm failed";
+        }
+        void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED) {
+            LOG(FATAL) << "mmap for shm failed";
+        }
+        close(fd);
+        return ptr;
+    }
+
+    // Touches every page, threads take contiguous chunks.
+    static void prefault(void *ptr, uint64_t size, uint64_t page, int threads) {
+        uint64_t pages = (size + page - 1) / page;
+        uint64_t chunk = (pages + threads - 1) / threads;
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([=]() {
+                for (uint64_t p = t * chunk; p < std::min(pages, (t + 1) * chunk); ++p) {
+                    ((volatile char *)ptr)[p * page] = 0;
+                }
+            });
+        }
+        for (auto &w : workers) {
+            w.join();
+        }
     }
 
     inline uint64_t turn(uint64_t ticket) {
         return ticket / n_;
     }
+
+    static inline uint64_t alignUp(uint64_t len) {
+        return (len + kCacheLineSize - 1) / kCacheLineSize * kCacheLineSize;
+    }
 };
 };  // namespace rdma
 
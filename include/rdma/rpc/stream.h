@@ -0,0 +1,60 @@
+#ifndef RDMA_RPC_STREAM_H_
+#define RDMA_RPC_STREAM_H_
+
+#include "rdma/rpc/common.h"
+
+namespace rdma {
+
+// Streaming RPC over UD and RC sessions.
+// The client opens a stream with one request, the server handler then emits chunks until it says it was the last.
+// At most kStreamWindow chunks are unacknowledged: the client acks what it consumed every kStreamWindow / 2
+// chunks, so a slow reader throttles the server. Chunks are delivered in order.
+// On the wire a chunk is a message with rpc_id kRpcStreamChunk and the seq of the request,
+// its identifier carries the chunk index in ctx_id and kStreamLast in qp_id.
+// An RC stream cancelled by the client is ended by an empty kStreamLast chunk, so the client knows when no more
+// chunks will take its receives.
+constexpr int kStreamWindow = 16;
+constexpr uint16_t kStreamLast = 1;
+
+// Client side of a stream, see Rpc::openStream.
+struct RpcStream {
+    explicit RpcStream(RpcContext *rpc_ctx);
+
+    // Next chunk in order, valid until the following call. nullptr at the end of the stream or on timeout.
+    MsgBuf *next(size_t retry_times = UINT64_MAX);
+    inline bool done() {
+        return next_idx > last_idx;
+    }
+    void onChunk(MsgBuf *rbuf);
+
+    Rpc *rpc{};
+    RpcSession *session{};
+    MsgBufPair *req{};
+    uint64_t seq{};
+    MsgBuf chunks[kStreamWindow];  // chunk i in slot i % kStreamWindow.
+    bool present[kStreamWindow]{};
+    uint32_t next_idx{};  // next chunk to deliver.
+    uint32_t last_idx{ UINT32_MAX };
+    uint32_t acked{};  // consumed chunks reported to the server.
+    bool delivering{};  // chunk next_idx is out to the caller.
+    MsgBufPair ack;
+};
+
+// Server side of a stream.
+struct ServerStream {
+    explicit ServerStream(RpcContext *rpc_ctx);
+
+    ReqHandle *handle;  // addressing of the client, its buf holds the request and the chunk being built.
+    MsgBufPair pair;
+    MsgBuf *chunk_bufs[kStreamWindow];  // chunk i is built in chunk_bufs[i % kStreamWindow].
+    MsgBuf *end_buf;                    // final chunk of a cancelled RC stream.
+    RpcIdentifier client;
+    uint64_t seq{};
+    uint32_t next{};   // next chunk to emit.
+    uint32_t acked{};  // chunks consumed by the client.
+    bool active{};
+};
+
+}  // namespace rdma
+
+#endif  // RDMA_RPC_STREAM_H_
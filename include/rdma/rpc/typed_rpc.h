@@ -0,0 +1,115 @@
+#ifndef RDMA_RPC_TYPED_RPC_H_
+#define RDMA_RPC_TYPED_RPC_H_
+
+#include <optional>
+#include <tuple>
+#include <type_traits>
+
+#include "rdma/rpc/rpc.h"
+#include "utils/serialize.h"
+
+namespace rdma {
+
+// Typed RPCs: RpcMethod<rpc_id, Resp(Args...)> binds an rpc_id to a signature.
+// Arguments and response are packed by m_serialize / m_deserialize right into the registered MsgBufs,
+// so they are POD types, std::string or Slice (pointing into the message, valid until the buffer is reused).
+// What doesn't fit a MsgBuf is refused before it's written: the stub fails, a response that is too large
+// comes back empty and fails the call.
+//
+//   using Get = RpcMethod<7, uint64_t(uint64_t)>;
+//   uint64_t get(void *context, uint64_t key);
+//   Get::reg<get>(&server_ctx);
+//   std::optional<uint64_t> v = Get::call(&rpc, &session, buf, key);
+template<uint8_t kRpcId, class Sig>
+struct RpcMethod;
+
+template<uint8_t kRpcId, class Resp, class... Args>
+struct RpcMethod<kRpcId, Resp(Args...)> {
+    static constexpr uint8_t id = kRpcId;
+    using Handler = Resp (*)(void *, Args...);
+    // Outcome of call(): the response, or nothing when the call failed. bool for a void response.
+    using Result = std::conditional_t<std::is_void_v<Resp>, bool, std::optional<Resp>>;
+
+    // false, with buf untouched, when ts don't fit.
+    template<class... Ts>
+    static inline bool pack(MsgBuf *buf, const Ts &...ts) {
+        if constexpr (sizeof...(Ts) == 0) {
+            buf->size = 0;
+        } else {
+            uint64_t size = m_serialized_size(ts...);
+            if (unlikely(size > sizeof(buf->buf))) {
+                LOG(ERROR) << "rpc " << (int)kRpcId << " message of " << size << " bytes, at most " << sizeof(buf->buf);
+                return false;
+            }
+            buf->size = m_serialize((char *)buf->buf, ts...);
+        }
+        return true;
+    }
+
+    template<class... Ts>
+    static inline void unpack(MsgBuf *buf, Ts &...ts) {
+        if constexpr (sizeof...(Ts) > 0) {
+            m_deserialize((const char *)buf->buf, buf->size, ts...);
+        }
+    }
+
+    // Client stubs, nothing is sent when the arguments don't fit.
+    static inline bool send(Rpc *rpc, RpcSession *session, MsgBufPair *buf, const Args &...args) {
+        return pack(buf->send_buf, args...) && rpc->send(session, kRpcId, buf);
+    }
+
+    // A future without buf when nothing was sent.
+    static inline RpcFuture sendAsync(Rpc *rpc, RpcSession *session, MsgBufPair *buf, const Args &...args) {
+        if (!pack(buf->send_buf, args...)) return RpcFuture{ rpc, nullptr };
+        return rpc->sendAsync(session, kRpcId, buf);
+    }
+
+    // Whether a completed request got a response, the server sends an empty one when it couldn't pack it.
+    static inline bool responded(MsgBufPair *buf) {
+        return std::is_void_v<Resp> || buf->recv_buf->size > 0;
+    }
+
+    // Response of a completed request that responded().
+    static inline Resp response(MsgBufPair *buf) {
+        if constexpr (!std::is_void_v<Resp>) {
+            Resp resp;
+            unpack(buf->recv_buf, resp);
+            return resp;
+        }
+    }
+
+    static inline Result call(Rpc *rpc, RpcSession *session, MsgBufPair *buf, const Args &...args) {
+        if (!send(rpc, session, buf, args...) || !rpc->recv(buf) || !responded(buf)) return Result{};
+        if constexpr (std::is_void_v<Resp>) {
+            return true;
+        } else {
+            return response(buf);
+        }
+    }
+
+    // Server side, the thunk is a plain function so the request loop calls it directly.
+    template<Handler handler>
+    static inline void reg(RpcContext *rpc_ctx, bool dispatch = false) {
+        rpc_ctx->regRawFunc(kRpcId, thunk<handler>, dispatch);
+    }
+
+    template<Handler handler>
+    static void thunk(ReqHandle *req, void *context) {
+        std::tuple<std::decay_t<Args>...> args;
+        std::apply([&](auto &...a) { unpack(req->buf->recv_buf, a...); }, args);
+        if constexpr (std::is_void_v<Resp>) {
+            std::apply([&](auto &...a) { handler(context, a...); }, args);
+            req->buf->send_buf->size = 0;
+        } else {
+            Resp resp = std::apply([&](auto &...a) { return handler(context, a...); }, args);
+            if (!pack(req->buf->send_buf, resp)) {
+                req->buf->send_buf->size = 0;
+            }
+        }
+        req->response();
+    }
+};
+
+}  // namespace rdma
+
+#endif  // RDMA_RPC_TYPED_RPC_H_
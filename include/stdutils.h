@@ -18,7 +18,9 @@
 #include "utils/third_party/rwlock.h"
 #include "utils/third_party/skiplist.h"
 #include "utils/timer.h"
+#include "utils/trace.h"
 #include "utils/type_traits.h"
 #include "utils/v_rwlock.h"
+#include "utils/work_stealing.h"
 
 #endif  // STDUTILS_H_
\ No newline at end of file
@@ -1,6 +1,9 @@
 #ifndef BENCHMARK_H_
 #define BENCHMARK_H_
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <thread>
 
 #include "defs.h"
@@ -14,6 +17,63 @@ struct TotalOp {
     char pad_back[hardware_destructive_interference_size - sizeof(uint64_t)];
 };
 
+// Latency histogram, log-linear: values below 64 exactly, then 64 linear buckets per power of 2 (< 1.6% error).
+// Record from a single thread only (one histogram per thread), merge them once the threads are joined.
+struct alignas(hardware_destructive_interference_size) LatencyHist {
+    static constexpr int kSubBits = 6;
+    static constexpr int kBuckets = (64 - kSubBits + 1) << kSubBits;
+
+    inline static int bucket(uint64_t v) {
+        if (v < (1ull << kSubBits)) return v;
+        int shift = 63 - __builtin_clzll(v) - kSubBits;
+        return ((shift + 1) << kSubBits) + ((v >> shift) & ((1 << kSubBits) - 1));
+    }
+
+    // Lower bound of bucket b.
+    inline static uint64_t value(int b) {
+        if (b < (1 << kSubBits)) return b;
+        int shift = (b >> kSubBits) - 1;
+        return ((1ull << kSubBits) + (b & ((1 << kSubBits) - 1))) << shift;
+    }
+
+    inline void record(uint64_t v) {
+        ++counts[bucket(v)];
+        ++cnt;
+        max = std::max(max, v);
+    }
+
+    inline void merge(const LatencyHist &o) {
+        for (int i = 0; i < kBuckets; ++i) counts[i] += o.counts[i];
+        cnt += o.cnt;
+        max = std::max(max, o.max);
+    }
+
+    inline void reset() {
+        *this = LatencyHist();
+    }
+
+    // p in [0, 100].
+    inline uint64_t percentile(double p) const {
+        uint64_t rank = std::ceil(p / 100 * cnt), seen = 0;
+        for (int i = 0; i < kBuckets; ++i) {
+            seen += counts[i];
+            if (seen >= rank && seen > 0) return std::min(value(i), max);
+        }
+        return max;
+    }
+
+    uint64_t counts[kBuckets]{};
+    uint64_t cnt{};
+    uint64_t max{};
+};
+
+// Result of a timed run, latencies in us.
+struct BenchmarkReport {
+    uint64_t ops;
+    double tput;  // ops/s.
+    double p50, p90, p99, p999, max;
+};
+
 /*
  * A simple benchmark util.
  * total_op is an array of a thread's total ops, used to calculate tput,
@@ -21,6 +81,11 @@ struct TotalOp {
  * param to pass: strategy, num_threads, total_op array and a lambda (or other function)
  * Action: this class will create num_threads threads, initialize my_thread_id and my_numa_id, then run.
  * By using printTputAndJoin, we can get the throughput.
+ *
+ * Timed mode: the threads loop while Benchmark::running() and record latencies (ns) into their own
+ * LatencyHist while Benchmark::measuring(), then
+ *   BenchmarkReport r = bm.measure(warmup_s, duration_s, hists);
+ * waits for the warmup, measures for duration_s, stops and joins the threads and reports ops/s and percentiles.
  */
 class Benchmark {
 public:
@@ -28,6 +93,8 @@ public:
     template<class Function, class... Args>
     inline static Benchmark run(BindCoreStrategy strategy, uint64_t num_threads, TotalOp *total_op, Function &&f,
                                 Args &&...args) {
+        // The phase is shared by every run of the process, a previous one left it stopped.
+        phase_.store(kWarmup, std::memory_order_relaxed);
         Benchmark benchmark;
         benchmark.strategy_ = strategy;
         benchmark.total_op_ = total_op;
@@ -46,9 +113,18 @@ public:
         return benchmark;
     }
 
+    inline static bool running() {
+        return phase_.load(std::memory_order_relaxed) != kStop;
+    }
+
+    inline static bool measuring() {
+        return phase_.load(std::memory_order_relaxed) == kMeasure;
+    }
+
+    // Runs until the threads return or stop is called.
     inline void printTputAndJoin(std::string name = "") {
         uint64_t cur = 0, prev = 0;
-        while (true) {
+        while (running()) {
             cur = 0;
             for (size_t i = 0; i < num_threads_; ++i) {
                 cur += total_op_[i].ops;
@@ -70,7 +146,57 @@ public:
         }
     }
 
+    inline static void stop() {
+        phase_.store(kStop, std::memory_order_relaxed);
+    }
+
+    // hists holds num_threads histograms indexed like total_op, or nullptr to only count ops.
+    inline BenchmarkReport measure(double warmup_s, double duration_s, LatencyHist *hists = nullptr,
+                                   std::string name = "") {
+        std::this_thread::sleep_for(std::chrono::duration<double>(warmup_s));
+        uint64_t begin_ops = sumOps();
+        Timer timer;
+        timer.begin();
+        phase_.store(kMeasure, std::memory_order_relaxed);
+        std::this_thread::sleep_for(std::chrono::duration<double>(duration_s));
+        phase_.store(kStop, std::memory_order_relaxed);
+        uint64_t ops = sumOps() - begin_ops;
+        double secs = timer.end().elapsed(Timer::s);
+        for (size_t i = 0; i < num_threads_; ++i) {
+            threads_[i].join();
+        }
+
+        LatencyHist all;
+        for (size_t i = 0; hists != nullptr && i < num_threads_; ++i) {
+            all.merge(hists[i]);
+        }
+        BenchmarkReport r{ ops,
+                           ops / secs,
+                           all.percentile(50) / 1e3,
+                           all.percentile(90) / 1e3,
+                           all.percentile(99) / 1e3,
+                           all.percentile(99.9) / 1e3,
+                           all.max / 1e3 };
+        LOG(INFO) << name << " Throughput: " << r.tput / 1e6 << " Mops/s";
+        if (all.cnt > 0) {
+            LOG(INFO) << name << " Latency(us): p50 " << r.p50 << " p90 " << r.p90 << " p99 " << r.p99 << " p99.9 "
+                      << r.p999 << " max " << r.max;
+        }
+        return r;
+    }
+
 private:
+    enum Phase { kWarmup, kMeasure, kStop };
+
+    inline uint64_t sumOps() {
+        uint64_t ops = 0;
+        for (size_t i = 0; i < num_threads_; ++i) {
+            ops += total_op_[i].ops;
+        }
+        return ops;
+    }
+
+    static inline std::atomic<int> phase_{ kWarmup };
     uint64_t num_threads_;
     Thread *threads_;
     TotalOp *total_op_;
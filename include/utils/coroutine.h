@@ -39,12 +39,19 @@ struct Coroutine {
 
 constexpr uint64_t kMaxCoroutinesPerThread = 32;
 
+// Round-robin over the coroutines that are not parked.
+// The idle step, which should wake parked coroutines, runs once per round: a coroutine that keeps yielding
+// doesn't hold back the others' wakeups.
 struct CoroScheduler {
     using coro_t = boost::coroutines2::coroutine<void>;
     int cur_index_;
     int coro_size_;
     coro_t::push_type *yield_;
     Coroutine *coros_[kMaxCoroutinesPerThread];
+    bool parked_[kMaxCoroutinesPerThread];
+    bool in_coro_;
+    void (*idle_fn_)(void *);
+    void *idle_arg_;
 
     template<class Function, class... Args>
     inline void insert(Function &&f, Args &&...args) {
@@ -57,15 +64,39 @@ struct CoroScheduler {
 
     inline bool next() {
         int last_index = cur_index_;
+        bool alive = false;
         do {
             cur_index_ = (cur_index_ + 1) % coro_size_;
+            if (cur_index_ == 0 && idle_fn_ != nullptr) idle_fn_(idle_arg_);
+            if (coros_[cur_index_]->finished()) continue;
+            alive = true;
+            if (parked_[cur_index_]) continue;
             this->yield_ = coros_[cur_index_]->yield_;
-            if (!coros_[cur_index_]->finished()) {
-                coros_[cur_index_]->run();
-                return true;
-            }
+            in_coro_ = true;
+            coros_[cur_index_]->run();
+            in_coro_ = false;
+            return true;
         } while (cur_index_ != last_index);
-        return false;
+        return alive;
+    }
+
+    inline void setIdle(void (*fn)(void *), void *arg) {
+        idle_fn_ = fn;
+        idle_arg_ = arg;
+    }
+
+    inline bool inCoroutine() {
+        return in_coro_;
+    }
+
+    // Yield until wake(coro_id()).
+    inline void park() {
+        parked_[cur_index_] = true;
+        yield();
+    }
+
+    inline void wake(int id) {
+        parked_[id] = false;
     }
 
     inline int coro_id() {
@@ -8,6 +8,7 @@
 
 #include "utils/defs.h"
 #include "utils/log.h"
+#include "utils/timer.h"
 
 /*
  * Some helper functions.
@@ -16,10 +17,9 @@ inline void fence() {
     asm volatile("" ::: "memory");
 }
 
+// Raw cycles, see TscClock for conversions and fenced reads.
 inline uint64_t rdtsc() {
-    uint64_t lo, hi;
-    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
-    return ((uint64_t)hi << 32) | lo;
+    return TscClock::now();
 }
 
 inline void prefetch(const void *ptr) {
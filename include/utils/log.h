@@ -5,33 +5,318 @@
 #include <glog/logging.h>
 #else
 #include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
-#include <iostream>
-#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ostream>
+#include <streambuf>
 #include <string>
+#include <thread>
+
+/*
+ * Asynchronous logging. A line is formatted into a preallocated per-thread buffer and pushed to the thread's
+ * SPSC queue, a background thread writes the queues to stderr. Logging never blocks the caller: a line that
+ * finds its queue full is dropped and counted. Lines of one thread stay in order, lines of different threads
+ * may interleave a little late.
+ * Every INFO and WARNING call site prints at most kSiteLinesPerSec lines per second, the lines it suppressed are
+ * reported with the next one it prints. ERROR and FATAL lines are never suppressed. A FATAL line is flushed, then
+ * the program aborts. Logger::flush() flushes on demand.
+ * A thread holds a queue from its first line to its exit, the writer frees the queue once it wrote what is left.
+ */
+
+constexpr int kLogLineSize = 512;
+constexpr uint32_t kSiteLinesPerSec = 100;
+
+struct LogLine {
+    uint32_t len;
+    char text[kLogLineSize];
+};
+
+// Single producer (the logging thread), single consumer (the writer thread).
+class LogQueue {
+public:
+    static constexpr uint64_t kCapacity = 256;
+
+    inline bool push(const LogLine &line) {
+        uint64_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == kCapacity) return false;
+        LogLine &slot = lines_[tail % kCapacity];
+        slot.len = line.len;
+        memcpy(slot.text, line.text, line.len);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    inline LogLine *front() {
+        uint64_t head = head_.load(std::memory_order_relaxed);
+        return head == tail_.load(std::memory_order_acquire) ? nullptr : &lines_[head % kCapacity];
+    }
+
+    inline void pop() {
+        head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    inline bool empty() {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+
+    // By the producer after its last push.
+    inline void retire() {
+        retired_.store(true, std::memory_order_release);
+    }
+
+    inline bool retired() {
+        return retired_.load(std::memory_order_acquire);
+    }
+
+private:
+    alignas(64) std::atomic<uint64_t> head_{ 0 };
+    alignas(64) std::atomic<uint64_t> tail_{ 0 };
+    std::atomic<bool> retired_{ false };
+    LogLine lines_[kCapacity];
+};
+
+class Logger {
+public:
+    static constexpr int kMaxThreads = 1024;
+    static constexpr int kIdleSleepUs = 1000;
+    static constexpr int kFlushTimeoutMs = 1000;
+
+    static Logger &get() {
+        static Logger logger;
+        return logger;
+    }
+
+    // The writer is gone (static destruction), lines are written synchronously.
+    inline static bool stopped() {
+        return stopped_.load(std::memory_order_acquire);
+    }
+
+    // Queue of the calling thread, nullptr while every slot is taken. Retired when the thread exits.
+    inline LogQueue *localQueue() {
+        thread_local LocalQueue local;
+        if (local.queue == nullptr) {
+            local.queue = attach();
+        }
+        return local.queue;
+    }
+
+    inline void submit(const LogLine &line) {
+        LogQueue *queue = localQueue();
+        if (queue == nullptr || !queue->push(line)) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Waits until the queued lines are written, up to kFlushTimeoutMs.
+    static void flush() {
+        if (stopped()) return;
+        Logger &logger = get();
+        for (int i = 0; i < kFlushTimeoutMs * 1000 / kIdleSleepUs; ++i) {
+            if (logger.allEmpty()) return;
+            std::this_thread::sleep_for(std::chrono::microseconds(kIdleSleepUs));
+        }
+    }
+
+    inline static void writeOut(const char *buf, size_t len) {
+        while (len > 0) {
+            ssize_t n = ::write(STDERR_FILENO, buf, len);
+            if (n <= 0) return;
+            buf += n;
+            len -= n;
+        }
+    }
+
+private:
+    struct LocalQueue {
+        ~LocalQueue() {
+            // Past the logger's destruction nobody reads it any more.
+            if (queue != nullptr && !stopped()) queue->retire();
+        }
+        LogQueue *queue = nullptr;
+    };
+
+    Logger() {
+        running_.store(true, std::memory_order_release);
+        thread_ = std::thread([this]() { run(); });
+    }
+
+    // Takes a free slot for a new queue of the calling thread.
+    LogQueue *attach() {
+        LogQueue *queue = nullptr;
+        for (int i = 0; i < kMaxThreads; ++i) {
+            if (queues_[i].load(std::memory_order_relaxed) != nullptr) continue;
+            if (queue == nullptr) queue = new LogQueue;
+            LogQueue *expected = nullptr;
+            if (!queues_[i].compare_exchange_strong(expected, queue, std::memory_order_release)) continue;
+            // The writer sweeps [0, queue_cnt_).
+            int cnt = queue_cnt_.load(std::memory_order_relaxed);
+            while (cnt <= i && !queue_cnt_.compare_exchange_weak(cnt, i + 1, std::memory_order_release)) {
+            }
+            return queue;
+        }
+        delete queue;
+        return nullptr;
+    }
+
+    ~Logger() {
+        running_.store(false, std::memory_order_release);
+        thread_.join();
+        drain();
+        stopped_.store(true, std::memory_order_release);
+    }
+
+    void run() {
+        while (running_.load(std::memory_order_acquire)) {
+            if (!drain()) {
+                std::this_thread::sleep_for(std::chrono::microseconds(kIdleSleepUs));
+            }
+        }
+    }
+
+    // Writes out what is queued, in batches. Returns whether there was anything.
+    bool drain() {
+        static char out[64 * kLogLineSize];
+        size_t len = 0;
+        bool any = false;
+        int n = std::min(queue_cnt_.load(std::memory_order_acquire), kMaxThreads);
+        for (int i = 0; i < n; ++i) {
+            LogQueue *queue = queues_[i].load(std::memory_order_acquire);
+            if (queue == nullptr) continue;  // free slot.
+            // Checked first, the lines of a retired queue are all pushed.
+            bool retired = queue->retired();
+            for (LogLine *line = queue->front(); line != nullptr; line = queue->front()) {
+                if (len + line->len > sizeof(out)) {
+                    writeOut(out, len);
+                    len = 0;
+                }
+                memcpy(out + len, line->text, line->len);
+                len += line->len;
+                queue->pop();
+                any = true;
+            }
+            if (retired) {
+                // Only the writer frees queues, so none is freed under it.
+                queues_[i].store(nullptr, std::memory_order_release);
+                delete queue;
+            }
+        }
+        writeOut(out, len);
+        uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+        if (dropped > 0) {
+            char msg[kLogLineSize];
+            int n = snprintf(msg, sizeof(msg), "[log.h:%d:WARNING] %lu log lines dropped, queues full\n", __LINE__,
+                             dropped);
+            writeOut(msg, n);
+        }
+        return any;
+    }
+
+    inline bool allEmpty() {
+        int n = std::min(queue_cnt_.load(std::memory_order_acquire), kMaxThreads);
+        for (int i = 0; i < n; ++i) {
+            LogQueue *queue = queues_[i].load(std::memory_order_acquire);
+            if (queue != nullptr && !queue->empty()) return false;
+        }
+        return true;
+    }
+
+    static inline std::atomic<bool> stopped_{ false };
+    std::atomic<LogQueue *> queues_[kMaxThreads]{};
+    std::atomic<int> queue_cnt_{ 0 };  // slots ever taken, up to the highest.
+    std::atomic<uint64_t> dropped_{ 0 };
+    std::atomic<bool> running_;
+    std::thread thread_;
+};
+
+// Per call site rate limit, a window of one second.
+struct LogSite {
+    static constexpr bool limited(const char *level) {
+        return level[0] != 'E' && level[0] != 'F';
+    }
+
+    inline bool allow() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        uint64_t now = ts.tv_sec;
+        if (now != window.load(std::memory_order_relaxed)) {
+            window.store(now, std::memory_order_relaxed);
+            printed.store(0, std::memory_order_relaxed);
+        }
+        if (printed.fetch_add(1, std::memory_order_relaxed) < kSiteLinesPerSec) return true;
+        suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    std::atomic<uint64_t> window{ 0 };
+    std::atomic<uint32_t> printed{ 0 };
+    std::atomic<uint32_t> suppressed{ 0 };
+};
+
+// Formats into a LogLine, truncating what does not fit.
+class LogLineBuf : public std::streambuf {
+public:
+    LogLineBuf() : os(this) {}
+
+    inline void reset() {
+        setp(line.text, line.text + kLogLineSize - 1);  // room for the newline.
+        os.clear();
+    }
+
+    inline LogLine &finish() {
+        line.len = pptr() - pbase();
+        line.text[line.len++] = '\n';
+        return line;
+    }
+
+    LogLine line;
+    std::ostream os;
+    bool busy{ false };
+};
 
-// Attention: stringstream has multi-thread performance issues,
-// but never mind because no one will frequently log in the multi-threading case.
 class LogStream {
 public:
     static constexpr int kMaxFmtLen = 255;
-    LogStream(const char *file, int line, const char *level) {
-        std::string filename = std::string(file);
-        size_t pos = filename.find_last_of('/');
-        if (pos != std::string::npos) {
-            filename = filename.substr(pos + 1);
+    LogStream(const char *file, int line, const char *level, LogSite &site) : fatal_(level[0] == 'F') {
+        thread_local LogLineBuf local;
+        owned_ = local.busy;  // a LOG inside a LOG argument.
+        buf_ = owned_ ? new LogLineBuf : &local;
+        buf_->busy = true;
+        buf_->reset();
+        const char *filename = strrchr(file, '/');
+        buf_->os << "[" << (filename != nullptr ? filename + 1 : file) << ":" << line << ":" << level << "] ";
+        uint32_t suppressed = site.suppressed.exchange(0, std::memory_order_relaxed);
+        if (suppressed > 0) {
+            buf_->os << "(" << suppressed << " suppressed) ";
         }
-        ss_ << "[" + filename + ":" + std::to_string(line) + ":" + level + "] ";
     }
 
     ~LogStream() {
-        ss_ << std::endl;
-        std::cerr << ss_.str();
+        LogLine &line = buf_->finish();
+        if (Logger::stopped()) {
+            Logger::writeOut(line.text, line.len);
+        } else {
+            Logger::get().submit(line);
+            if (fatal_) Logger::flush();
+        }
+        if (owned_) {
+            delete buf_;
+        } else {
+            buf_->busy = false;
+        }
+        if (fatal_) abort();
     }
 
     template<class T>
     inline LogStream &operator<<(const T &t) {
-        ss_ << t;
+        buf_->os << t;
         return *this;
     }
 
@@ -39,18 +324,21 @@ public:
         char va_buf[1 + kMaxFmtLen];
         va_list args;
         va_start(args, format);
-        sprintf(va_buf, format, args);
+        vsnprintf(va_buf, sizeof(va_buf), format, args);
         va_end(args);
-        ss_ << va_buf;
+        buf_->os << va_buf;
         return *this;
     }
 
 private:
-    std::stringstream ss_;
+    LogLineBuf *buf_;
+    bool owned_;
+    bool fatal_;
 };
 
-#define LOG(level) \
-    if (true) LogStream(__FILE__, __LINE__, #level)
+#define LOG(level)                                                                \
+    if (static LogSite log_site_; !LogSite::limited(#level) || log_site_.allow()) \
+    LogStream(__FILE__, __LINE__, #level, log_site_)
 #ifdef NDEBUG
 class NullStream {
 public:
@@ -69,4 +357,4 @@ public:
 #endif  // NDEBUG
 #endif  // USE_GLOG
 
-#endif  // UTILS_LOG_H_
\ No newline at end of file
+#endif  // UTILS_LOG_H_
@@ -42,6 +42,21 @@ uint64_t serialize_impl(char *buf, T0 t0, Ts... args) {
     return size;
 }
 
+// \return The size serialize_impl writes for the same arguments, to check the room first.
+template<bool multi_string, class T0, class... Ts>
+uint64_t serialized_size_impl(const T0 &t0, const Ts &...args) {
+    uint64_t size = 0;
+    if constexpr (std::is_same_v<T0, Slice> || std::is_same_v<T0, std::string>) {
+        size += (multi_string ? sizeof(uint64_t) : 0) + t0.size();
+    } else {
+        size += std::max(sizeof(uint64_t), sizeof(T0));
+    }
+    if constexpr (sizeof...(args) > 0) {
+        size += serialized_size_impl<multi_string>(args...);
+    }
+    return size;
+}
+
 // \param buf The buffer to deserialize from.
 // \param size The size of the buffer.
 // \param args The object to deserialize. Supported types: Slice, std::string, POD types, pointer of POD types.
@@ -88,6 +103,11 @@ uint64_t serialize(char *buf, T0 t0, Ts... args) {
     return Serializer::serialize_impl<false>(buf, t0, args...);
 }
 
+template<class T0, class... Ts>
+uint64_t serialized_size(const T0 &t0, const Ts &...args) {
+    return Serializer::serialized_size_impl<false>(t0, args...);
+}
+
 template<class T0, class... Ts>
 void deserialize(const char *buf, uint64_t size, T0 &t0, Ts &...args) {
     Serializer::deserialize_impl<false>(buf, size, t0, args...);
@@ -98,6 +118,11 @@ uint64_t m_serialize(char *buf, T0 t0, Ts... args) {
     return Serializer::serialize_impl<true>(buf, t0, args...);
 }
 
+template<class T0, class... Ts>
+uint64_t m_serialized_size(const T0 &t0, const Ts &...args) {
+    return Serializer::serialized_size_impl<true>(t0, args...);
+}
+
 template<class T0, class... Ts>
 void m_deserialize(const char *buf, uint64_t size, T0 &t0, Ts &...args) {
     Serializer::deserialize_impl<true>(buf, size, t0, args...);
@@ -1,13 +1,108 @@
 #ifndef TIMER_H_
 #define TIMER_H_
 
+#include <cpuid.h>
 #include <time.h>
 
 #include <cstdint>
 #include <string>
 
+#include "utils/log.h"
+
+/*
+ * TSC clock: now() is a bare rdtsc (~10ns), cycles are converted with a ratio calibrated against
+ * CLOCK_MONOTONIC_RAW on first use. Call calibrate() at startup to keep the ~10ms calibration out of measurements.
+ * Needs an invariant TSC (constant rate, synced across cores), otherwise a warning is logged.
+ * For measuring short sections use start() / stop(), which keep the measured code between the two reads.
+ */
+class TscClock {
+public:
+    static constexpr uint64_t kCalibrateNs = 10000000;
+
+    inline static uint64_t now() {
+        uint64_t lo, hi;
+        asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+        return (hi << 32) | lo;
+    }
+
+    // Earlier instructions have finished, later ones have not started.
+    inline static uint64_t start() {
+        uint64_t lo, hi;
+        asm volatile("lfence\n\trdtsc\n\tlfence" : "=a"(lo), "=d"(hi)::"memory");
+        return (hi << 32) | lo;
+    }
+
+    // Earlier instructions have finished, later ones have not started.
+    inline static uint64_t stop() {
+        uint64_t lo, hi;
+        asm volatile("rdtscp\n\tlfence" : "=a"(lo), "=d"(hi)::"rcx", "memory");
+        return (hi << 32) | lo;
+    }
+
+    // ns since an arbitrary point, comparable across threads.
+    inline static uint64_t nowNs() {
+        return toNs(now());
+    }
+
+    inline static uint64_t toNs(uint64_t cycles) {
+        return cycles * calibration().ns_per_cycle;
+    }
+
+    inline static double toUs(uint64_t cycles) {
+        return cycles * calibration().ns_per_cycle / 1e3;
+    }
+
+    inline static uint64_t fromNs(uint64_t ns) {
+        return ns * calibration().cycles_per_ns;
+    }
+
+    inline static double cyclesPerNs() {
+        return calibration().cycles_per_ns;
+    }
+
+    inline static bool invariant() {
+        return calibration().invariant;
+    }
+
+    inline static void calibrate() {
+        calibration();
+    }
+
+private:
+    struct Calibration {
+        double cycles_per_ns;
+        double ns_per_cycle;
+        bool invariant;
+    };
+
+    inline static const Calibration &calibration() {
+        static const Calibration c = measure();
+        return c;
+    }
+
+    static Calibration measure() {
+        Calibration c;
+        unsigned eax, ebx, ecx, edx;
+        c.invariant = __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1u << 8));
+        if (!c.invariant) {
+            LOG(WARNING) << "No invariant TSC, TscClock drifts with the CPU frequency";
+        }
+        timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+        uint64_t c0 = start(), c1, ns;
+        do {
+            clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+            c1 = stop();
+            ns = (t1.tv_sec - t0.tv_sec) * 1000000000ull + t1.tv_nsec - t0.tv_nsec;
+        } while (ns < kCalibrateNs);
+        c.cycles_per_ns = (double)(c1 - c0) / ns;
+        c.ns_per_cycle = 1 / c.cycles_per_ns;
+        return c;
+    }
+};
+
 /*
- * A simple timer using CLOCK_REALTIME
+ * A simple timer on TscClock.
  */
 
 class Timer {
@@ -21,17 +116,17 @@ public:
     };
 
     Timer &begin() {
-        clock_gettime(CLOCK_REALTIME, &start_);
+        start_ = TscClock::start();
         return *this;
     }
 
     Timer &end() {
-        clock_gettime(CLOCK_REALTIME, &end_);
+        end_ = TscClock::stop();
         return *this;
     }
 
     double elapsed(int unit = us) {
-        double elapsed = (end_.tv_sec - start_.tv_sec) * 1e9 + (end_.tv_nsec - start_.tv_nsec);
+        double elapsed = (end_ - start_) / TscClock::cyclesPerNs();
         switch (unit) {
             case ns:
                 return elapsed;
@@ -51,7 +146,7 @@ public:
     }
 
 private:
-    timespec start_, end_;
+    uint64_t start_, end_;
 };
 
-#endif  // TIMER_H_
\ No newline at end of file
+#endif  // TIMER_H_
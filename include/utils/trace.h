@@ -0,0 +1,271 @@
+#ifndef UTILS_TRACE_H_
+#define UTILS_TRACE_H_
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "utils/defs.h"
+#include "utils/timer.h"
+
+/*
+ * Hot-path event tracing: every thread appends fixed-size binary records (TSC, event, two args) to its own ring,
+ * which keeps the last kTraceRingSize events. A thread's ring goes to the next new thread once it exits, so at most
+ * Tracer::kMaxRings threads are traced at once. TRACE is one relaxed load and a branch while tracing is off;
+ * build with -DNO_TRACE to compile it out.
+ *
+ *   Tracer::enable(true);
+ *   Tracer::dumpOnSignal("/tmp/rpc.trace");  // kill -USR2 <pid>, or Tracer::dump(path) on demand.
+ *   Tracer::toChromeJson("/tmp/rpc.trace", "/tmp/rpc.json");  // or the trace_decode tool, open in chrome://tracing.
+ */
+
+// id, name, Chrome trace phase: 'B' / 'E' open and close a span, 'i' is an instant.
+#define TRACE_EVENTS(X)                    \
+    X(kTraceQPPoll, "qp_poll", 'i')        \
+    X(kTraceHandlerBegin, "handler", 'B')  \
+    X(kTraceHandlerEnd, "handler", 'E')    \
+    X(kTraceResponse, "response", 'i')     \
+    X(kTraceShmCommit, "shm_commit", 'i')  \
+    X(kTraceShmRecv, "shm_recv", 'i')      \
+    X(kTraceShmRespond, "shm_respond", 'i')
+
+enum TraceEvent : uint32_t {
+#define TRACE_EVENT_ID(id, name, ph) id,
+    TRACE_EVENTS(TRACE_EVENT_ID)
+#undef TRACE_EVENT_ID
+        kTraceEventCnt
+};
+
+#ifdef NO_TRACE
+#define TRACE(event, a, b) \
+    do {                   \
+    } while (0)
+#else
+#define TRACE(event, a, b)                                                \
+    do {                                                                  \
+        if (unlikely(Tracer::enabled())) Tracer::record((event), (a), (b)); \
+    } while (0)
+#endif
+
+struct TraceRecord {
+    uint64_t tsc;
+    uint32_t event;
+    uint32_t pad;
+    uint64_t a;
+    uint64_t b;
+};
+
+constexpr uint64_t kTraceRingSize = 1 << 16;  // records, 2MB per thread.
+
+struct TraceRing {
+    std::atomic<uint64_t> pos{ 0 };  // records ever written.
+    int tid{};
+    std::atomic<bool> in_use{ true };  // cleared when its thread exits, the next new thread takes it over.
+    TraceRecord recs[kTraceRingSize];
+};
+
+class Tracer {
+public:
+    static constexpr int kMaxRings = 1024;
+    static constexpr uint64_t kMagic = 0x3143415254435052;  // "RPCTRAC1"
+
+    // File layout: FileHeader, then per ring a RingHeader followed by cnt records, oldest first.
+    struct FileHeader {
+        uint64_t magic;
+        double cycles_per_ns;
+        uint64_t ring_cnt;
+    };
+    struct RingHeader {
+        uint64_t tid;
+        uint64_t cnt;
+    };
+
+    inline static bool enabled() {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    static void enable(bool on) {
+        TscClock::calibrate();  // not from the signal handler.
+        enabled_.store(on, std::memory_order_relaxed);
+    }
+
+    inline static void record(uint32_t event, uint64_t a, uint64_t b) {
+        TraceRing *ring = ring_;
+        if (unlikely(ring == nullptr)) {
+            ring = attach();
+            if (ring == nullptr) return;
+        }
+        uint64_t pos = ring->pos.load(std::memory_order_relaxed);
+        ring->recs[pos & (kTraceRingSize - 1)] = TraceRecord{ TscClock::now(), event, 0, a, b };
+        ring->pos.store(pos + 1, std::memory_order_release);
+    }
+
+    // Async-signal-safe. Records being written meanwhile may come out torn.
+    static bool dump(const char *path) {
+        int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        int n = std::min(ring_cnt_.load(std::memory_order_acquire), kMaxRings);
+        FileHeader hdr{ kMagic, TscClock::cyclesPerNs(), (uint64_t)n };
+        bool ok = writeAll(fd, &hdr, sizeof(hdr));
+        for (int i = 0; ok && i < n; ++i) {
+            TraceRing *ring = rings_[i];
+            uint64_t end = ring->pos.load(std::memory_order_acquire);
+            uint64_t cnt = std::min(end, kTraceRingSize), begin = end - cnt;
+            RingHeader rh{ (uint64_t)ring->tid, cnt };
+            ok = writeAll(fd, &rh, sizeof(rh));
+            // Oldest first: [begin, wrap) then [0, end).
+            uint64_t first = std::min(cnt, kTraceRingSize - (begin & (kTraceRingSize - 1)));
+            ok = ok && writeAll(fd, &ring->recs[begin & (kTraceRingSize - 1)], first * sizeof(TraceRecord));
+            ok = ok && writeAll(fd, &ring->recs[0], (cnt - first) * sizeof(TraceRecord));
+        }
+        close(fd);
+        return ok;
+    }
+
+    static void dumpOnSignal(const std::string &path, int sig = SIGUSR2) {
+        TscClock::calibrate();
+        strncpy(dump_path_, path.c_str(), sizeof(dump_path_) - 1);
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = [](int) { dump(dump_path_); };
+        sa.sa_flags = SA_RESTART;
+        sigaction(sig, &sa, nullptr);
+    }
+
+    // Decodes a dump into Chrome trace event JSON, timestamps in us from the first record.
+    static bool toChromeJson(const std::string &in_path, const std::string &out_path) {
+        static const char *names[] = {
+#define TRACE_EVENT_NAME(id, name, ph) name,
+            TRACE_EVENTS(TRACE_EVENT_NAME)
+#undef TRACE_EVENT_NAME
+        };
+        static const char phases[] = {
+#define TRACE_EVENT_PHASE(id, name, ph) ph,
+            TRACE_EVENTS(TRACE_EVENT_PHASE)
+#undef TRACE_EVENT_PHASE
+        };
+        std::ifstream in(in_path, std::ios::binary);
+        FileHeader hdr;
+        if (!in.read((char *)&hdr, sizeof(hdr)) || hdr.magic != kMagic) {
+            LOG(ERROR) << "Not a trace dump: " << in_path;
+            return false;
+        }
+        std::vector<std::pair<uint64_t, std::vector<TraceRecord>>> rings(hdr.ring_cnt);
+        uint64_t base = UINT64_MAX;
+        for (auto &[tid, recs] : rings) {
+            RingHeader rh;
+            if (!in.read((char *)&rh, sizeof(rh))) return false;
+            tid = rh.tid;
+            recs.resize(rh.cnt);
+            if (!in.read((char *)recs.data(), rh.cnt * sizeof(TraceRecord))) return false;
+            if (!recs.empty()) base = std::min(base, recs[0].tsc);
+        }
+
+        std::ofstream out(out_path);
+        out << "{\"traceEvents\":[\n";
+        bool first = true;
+        for (auto &[tid, recs] : rings) {
+            for (auto &r : recs) {
+                if (r.event >= kTraceEventCnt) continue;
+                out << (first ? "" : ",\n") << "{\"name\":\"" << names[r.event] << "\",\"ph\":\"" << phases[r.event]
+                    << "\",\"ts\":" << (r.tsc - base) / hdr.cycles_per_ns / 1e3 << ",\"pid\":0,\"tid\":" << tid
+                    << (phases[r.event] == 'i' ? ",\"s\":\"t\"" : "") << ",\"args\":{\"a\":" << r.a
+                    << ",\"b\":" << r.b << "}}";
+                first = false;
+            }
+        }
+        out << "\n]}\n";
+        return out.good();
+    }
+
+private:
+    struct RingOwner {
+        ~RingOwner() {
+            if (ring == nullptr) return;
+            ring_ = nullptr;
+            ring->in_use.store(false, std::memory_order_release);
+            free_rings_.fetch_add(1, std::memory_order_release);
+        }
+        TraceRing *ring = nullptr;
+    };
+
+    static TraceRing *attach() {
+        TraceRing *ring = reuse();
+        if (ring != nullptr) {
+            // The records of the exited thread go with its ring.
+            ring->pos.store(0, std::memory_order_relaxed);
+        } else {
+            ring = grow();
+            if (ring == nullptr) {
+                if (!cap_logged_.exchange(true, std::memory_order_relaxed)) {
+                    LOG(ERROR) << "More than " << kMaxRings << " threads traced at once, the others are not traced";
+                }
+                return nullptr;
+            }
+        }
+        ring->tid = syscall(SYS_gettid);
+        ring_ = ring;
+        static thread_local RingOwner owner;
+        owner.ring = ring;
+        return ring;
+    }
+
+    // A ring whose thread has exited, nullptr if none.
+    static TraceRing *reuse() {
+        if (free_rings_.load(std::memory_order_acquire) == 0) return nullptr;
+        int n = ring_cnt_.load(std::memory_order_acquire);
+        for (int i = 0; i < n; ++i) {
+            bool expect = false;
+            if (rings_[i]->in_use.load(std::memory_order_relaxed)) continue;
+            if (rings_[i]->in_use.compare_exchange_strong(expect, true, std::memory_order_acquire)) {
+                free_rings_.fetch_sub(1, std::memory_order_relaxed);
+                return rings_[i];
+            }
+        }
+        return nullptr;
+    }
+
+    static TraceRing *grow() {
+        if (ring_slot_.load(std::memory_order_relaxed) >= kMaxRings) return nullptr;
+        int idx = ring_slot_.fetch_add(1, std::memory_order_relaxed);
+        if (idx >= kMaxRings) return nullptr;
+        TraceRing *ring = new TraceRing;
+        // Publish before counting it, dump reads rings_[0, ring_cnt_).
+        rings_[idx] = ring;
+        int expect = idx;
+        while (!ring_cnt_.compare_exchange_weak(expect, idx + 1, std::memory_order_release)) {
+            expect = idx;
+        }
+        return ring;
+    }
+
+    static bool writeAll(int fd, const void *buf, size_t size) {
+        const char *p = (const char *)buf;
+        while (size > 0) {
+            ssize_t n = write(fd, p, size);
+            if (n <= 0) return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    static inline std::atomic<bool> enabled_{ false };
+    static inline thread_local TraceRing *ring_ = nullptr;
+    static inline TraceRing *rings_[kMaxRings];
+    static inline std::atomic<int> ring_slot_{ 0 };
+    static inline std::atomic<int> ring_cnt_{ 0 };
+    static inline std::atomic<int> free_rings_{ 0 };  // rings of exited threads.
+    static inline std::atomic<bool> cap_logged_{ false };
+    static inline char dump_path_[256];
+};
+
+#endif  // UTILS_TRACE_H_
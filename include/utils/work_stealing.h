@@ -0,0 +1,186 @@
+#ifndef WORK_STEALING_H_
+#define WORK_STEALING_H_
+
+#include <numa.h>
+
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "utils/defs.h"
+
+/*
+ * Bounded lock-free queues and a work-stealing thread pool.
+ * Capacities must be powers of 2, T should be trivially copyable (usually a pointer).
+ */
+
+// Single producer, single consumer.
+template<class T>
+class SPSCQueue {
+public:
+    explicit SPSCQueue(uint64_t capacity) : mask_(capacity - 1), items_(new T[capacity]) {}
+
+    ~SPSCQueue() {
+        delete[] items_;
+    }
+
+    inline bool push(const T &t) {
+        uint64_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_cache_ > mask_) {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if (tail - head_cache_ > mask_) return false;
+        }
+        items_[tail & mask_] = t;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    inline bool pop(T &t) {
+        uint64_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_cache_) {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+            if (head == tail_cache_) return false;
+        }
+        t = items_[head & mask_];
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only.
+    inline bool empty() {
+        return head_.load(std::memory_order_relaxed) == tail_.load(std::memory_order_acquire);
+    }
+
+private:
+    // Consumer side.
+    alignas(hardware_destructive_interference_size) std::atomic<uint64_t> head_{ 0 };
+    uint64_t tail_cache_{ 0 };
+    // Producer side.
+    alignas(hardware_destructive_interference_size) std::atomic<uint64_t> tail_{ 0 };
+    uint64_t head_cache_{ 0 };
+    alignas(hardware_destructive_interference_size) uint64_t mask_;
+    T *items_;
+};
+
+// Single producer, multiple consumers, FIFO: every consumer takes from the head with a CAS.
+// Not a Chase-Lev deque, whose owner pushes and pops at the bottom itself: here the producer is another
+// thread (the poller), so the worker that owns a queue and the thieves contend on the same end.
+template<class T>
+class SPMCQueue {
+public:
+    explicit SPMCQueue(uint64_t capacity) : mask_(capacity - 1), items_(new std::atomic<T>[capacity]) {}
+
+    ~SPMCQueue() {
+        delete[] items_;
+    }
+
+    // Producer only.
+    inline bool push(const T &t) {
+        uint64_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) > mask_) return false;
+        items_[tail & mask_].store(t, std::memory_order_relaxed);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Any thread.
+    inline bool pop(T &t) {
+        uint64_t head = head_.load(std::memory_order_acquire);
+        while (head < tail_.load(std::memory_order_acquire)) {
+            // The slot can't be reused before head moves, a stale read just fails the CAS.
+            T cur = items_[head & mask_].load(std::memory_order_relaxed);
+            if (head_.compare_exchange_weak(head, head + 1, std::memory_order_acq_rel)) {
+                t = cur;
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    alignas(hardware_destructive_interference_size) std::atomic<uint64_t> head_{ 0 };
+    alignas(hardware_destructive_interference_size) std::atomic<uint64_t> tail_{ 0 };
+    alignas(hardware_destructive_interference_size) uint64_t mask_;
+    std::atomic<T> *items_;
+};
+
+// A pool of NUMA-local workers fed by a single producer.
+// Tasks are spread round-robin over the workers' queues, a worker takes the oldest task of its own queue,
+// then steals the oldest of the others when it runs dry.
+template<class T>
+class WorkStealingPool {
+public:
+    static constexpr int kSpinRounds = 1024;
+
+    // fn(task, worker_id) runs in the workers.
+    WorkStealingPool(int n_workers, int numa, uint64_t queue_capacity, std::function<void(T, int)> fn)
+        : n_workers_(n_workers), fn_(fn) {
+        running_.store(true, std::memory_order_release);
+        for (int i = 0; i < n_workers; ++i) {
+            queues_.push_back(new SPMCQueue<T>(queue_capacity));
+        }
+        for (int i = 0; i < n_workers; ++i) {
+            threads_.emplace_back([this, numa, i]() {
+                numa_run_on_node(numa);
+                workerLoop(i);
+            });
+        }
+    }
+
+    ~WorkStealingPool() {
+        stop();
+        for (auto q : queues_) {
+            delete q;
+        }
+    }
+
+    // Producer only. Returns false when every queue is full.
+    inline bool submit(const T &t) {
+        for (int i = 0; i < n_workers_; ++i) {
+            next_ = next_ + 1 == n_workers_ ? 0 : next_ + 1;
+            if (queues_[next_]->push(t)) return true;
+        }
+        return false;
+    }
+
+    inline int size() {
+        return n_workers_;
+    }
+
+    void stop() {
+        running_.store(false, std::memory_order_release);
+        for (auto &t : threads_) {
+            if (t.joinable()) t.join();
+        }
+    }
+
+private:
+    void workerLoop(int me) {
+        int idle = 0;
+        while (running_.load(std::memory_order_acquire)) {
+            T t;
+            bool got = queues_[me]->pop(t);
+            for (int i = 1; !got && i < n_workers_; ++i) {
+                got = queues_[(me + i) % n_workers_]->pop(t);
+            }
+            if (got) {
+                fn_(t, me);
+                idle = 0;
+            } else if (++idle > kSpinRounds) {
+                std::this_thread::yield();
+            } else {
+                asm volatile("pause" ::: "memory");
+            }
+        }
+    }
+
+    int n_workers_;
+    int next_{ 0 };
+    std::function<void(T, int)> fn_;
+    std::vector<SPMCQueue<T> *> queues_;
+    std::vector<std::thread> threads_;
+    std::atomic<bool> running_;
+};
+
+#endif  // WORK_STEALING_H_
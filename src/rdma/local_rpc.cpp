@@ -0,0 +1,125 @@
+#include "rdma/rpc.h"
+
+#include "utils/defs.h"
+
+// In-process sessions, see LocalChannel in rdma/rpc/rpc.h.
+
+namespace rdma {
+
+namespace {
+
+std::mutex local_mtx;
+std::unordered_map<std::string, Rpc *> local_servers;
+
+}  // namespace
+
+Rpc *Rpc::findLocal(const std::string &ip, int port, int qp_id) {
+    std::lock_guard<std::mutex> lock(local_mtx);
+    auto it = local_servers.find(shm_key(ip, port, qp_id));
+    return it == local_servers.end() ? nullptr : it->second;
+}
+
+void Rpc::registerLocal() {
+    std::lock_guard<std::mutex> lock(local_mtx);
+    local_servers[shm_key(ctx->my_ip, ctx->my_port, identifier.qp_id)] = this;
+}
+
+void Rpc::unregisterLocal() {
+    std::lock_guard<std::mutex> lock(local_mtx);
+    auto it = local_servers.find(shm_key(ctx->my_ip, ctx->my_port, identifier.qp_id));
+    // A later server on the same address may have taken the entry over.
+    if (it != local_servers.end() && it->second == this) local_servers.erase(it);
+}
+
+bool Rpc::connectLocal(RpcSession *session, Rpc *server) {
+    {
+        std::lock_guard<std::mutex> lock(local_mtx);
+        // The server may be polling a channel, so a disconnected one is handed to the next client instead of freed.
+        int cnt = server->local_ch_cnt.load(std::memory_order_relaxed);
+        for (int i = 0; i < cnt && session->local == nullptr; ++i) {
+            if (!server->local_chs[i]->in_use) session->local = server->local_chs[i];
+        }
+        if (session->local == nullptr) {
+            if (cnt >= kMaxLocalSessions) {
+                LOG(ERROR) << "Too many in-process sessions, at most " << kMaxLocalSessions;
+                return false;
+            }
+            session->local = new LocalChannel(server);
+            server->local_chs[cnt] = session->local;
+            server->local_ch_cnt.store(cnt + 1, std::memory_order_release);
+        }
+        session->local->in_use = true;
+    }
+    local_sessions.push_back(session->local);
+    return true;
+}
+
+void Rpc::disconnectLocal(RpcSession *session) {
+    LocalChannel *ch = session->local;
+    while (ch->head != ch->tail) {
+        handleLocalResponses();
+    }
+    local_sessions.erase(std::find(local_sessions.begin(), local_sessions.end(), ch));
+    std::lock_guard<std::mutex> lock(local_mtx);
+    ch->in_use = false;
+}
+
+void Rpc::sendLocal(RpcSession *session, MsgBufPair *buf) {
+    LocalChannel *ch = session->local;
+    Rpc *server = ch->server;
+    while (unlikely(ch->tail - ch->head == LocalChannel::kDepth)) {
+        handleLocalResponses();
+    }
+    buf->ticket = ch->tail;
+    ch->sent[ch->tail++ % LocalChannel::kDepth] = buf;
+    if (server->local_inline) {
+        // Served right here, the response completes in order with the next poll whenever it is given.
+        server->serveLocal(ch, buf);
+        return;
+    }
+    ch->reqs.push(buf);
+    // Pairs with the sleeper check of the server's idle wait.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    server->shm_ring->serverWake();
+}
+
+void Rpc::handleLocalResponses() {
+    for (auto ch : local_sessions) {
+        while (ch->head != ch->tail) {
+            auto &done = ch->done[ch->head % LocalChannel::kDepth];
+            if (!done.load(std::memory_order_acquire)) break;
+            done.store(false, std::memory_order_relaxed);
+            ch->sent[ch->head++ % LocalChannel::kDepth]->complete();
+        }
+    }
+}
+
+int Rpc::handleLocalRequests() {
+    int cnt = 0;
+    int ch_cnt = local_ch_cnt.load(std::memory_order_acquire);
+    for (int i = 0; i < ch_cnt; ++i) {
+        LocalChannel *ch = local_chs[i];
+        MsgBufPair *buf;
+        while (ch->reqs.pop(buf)) {
+            ++cnt;
+            serveLocal(ch, buf);
+        }
+    }
+    return cnt;
+}
+
+void Rpc::serveLocal(LocalChannel *ch, MsgBufPair *buf) {
+    std::swap(buf->send_buf, buf->recv_buf);
+    uint8_t rpc_id = buf->recv_buf->rpc_hdr.identifier.rpc_id;
+    ReqHandle *handle = &ch->handles[buf->ticket % LocalChannel::kDepth];
+    *handle = ReqHandle{ this, buf, nullptr, 0, ReqHandle::kLocal, rpc_id };
+    handle->local = ch;
+    if (dispatcher != nullptr && ctx->dispatched[rpc_id]) {
+        // Workers respond to local requests by themselves.
+        if (likely(dispatcher->submit(handle))) return;
+        LOG(ERROR) << "Dispatch queues are full, run rpc " << (int)rpc_id << " inline";
+    }
+    ctx->invoke(rpc_id, handle, context);
+}
+
+}  // namespace rdma
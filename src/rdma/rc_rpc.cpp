@@ -1,256 +1,517 @@
-#include "rdma/rpc/rc_rpc.h"
+#include "rdma/rpc.h"
 
 #include "utils/defs.h"
 
-namespace rdma {
-RpcContext::RpcContext(const std::string &rpc_ip, int rpc_port, int id, int numa, uint8_t dev_port, int gid_index,
-                       int proto, const char *ipv4_subnet)
-    : ctx(rpc_ip, rpc_port, dev_port, gid_index, proto, ipv4_subnet) {
-    this->my_ip = rpc_ip;
-    this->my_port = rpc_port;
-    this->id = id;
-    this->numa = numa;
-    this->is_server = false;
-
-    this->funcs[kRpcNewConnection] = [](ReqHandle *handle, void *) {
-        handle->buf->send_buf->size = 1;
-        handle->response();
-    };
-}
-
-MsgBuf *RpcContext::allocBuf() {
-    MsgBuf *buf = new MsgBuf(this);
-    return buf;
-}
-
-Rpc::Rpc(RpcContext *rpc_ctx, void *context, int rpc_id) : ctx(rpc_ctx), context(context), conn_buf(rpc_ctx) {
-    cur_group = 0;
-    send_cnt = 0;
-    this->send_cq = rpc_ctx->ctx.createCQ();
-    this->recv_cq = rpc_ctx->ctx.createCQ();
+// RC transports of Rpc: RC send/recv and the RDMA write ring.
 
-    if (ctx->is_server) {
-        DLOG(INFO) << "Is server, allocating buffers";
-        if (posix_memalign((void **)&srv_bufs, kCacheLineSize, sizeof(MsgBuf) * kSrvBufCnt)) {
-            LOG(FATAL) << "Failed to allocate memory for server buffers";
-        }
-        for (int i = 0; i < kSrvBufCnt; ++i) {
-            new (srv_bufs + i) MsgBufPair(rpc_ctx);
-        }
-
-        srv_recv_sges = new ibv_sge[kSrvBufCnt];
-        srv_recv_wrs = new ibv_recv_wr[kSrvBufCnt];
-        for (int gi = 0; gi < kRecvWrGroupCnt; ++gi) {
-            int start = gi * kRecvWrGroupSize;
-            // Chained.
-            int end = start + kRecvWrGroupSize;
-            for (int i = start; i < end; ++i) {
-                srv_recv_sges[i].addr = (uint64_t)srv_bufs[i].recv_buf->buf;
-                srv_recv_sges[i].length = kMTU;
-                srv_recv_sges[i].lkey = srv_bufs[i].recv_buf->lkey;
-                srv_recv_wrs[i].wr_id = (uint64_t)&srv_bufs[i];
-                srv_recv_wrs[i].next = i == end - 1 ? nullptr : &srv_recv_wrs[i + 1];
-                srv_recv_wrs[i].num_sge = 1;
-                srv_recv_wrs[i].sg_list = &srv_recv_sges[i];
-            }
-            srv_recv_wr_hdrs[gi] = &srv_recv_wrs[start];
-        }
+namespace rdma {
+RingSession::RingSession(RpcContext *rpc_ctx, bool is_server)
+    : qp(nullptr), rmt_addr(0), rmt_rkey(0), head(0), tail(0), resp_bufs(nullptr), pairs(nullptr) {
+    uint64_t ring_size = sizeof(MsgBuf) * kRingSlots;
+    if (posix_memalign((void **)&ring, kCacheLineSize, ring_size)) {
+        LOG(FATAL) << "Failed to allocate memory for ring";
+    }
+    memset((void *)ring, 0, ring_size);
+    ring_mr = rpc_ctx->ctx.createMR(ring, ring_size);
+    for (int i = 0; i < kRingSlots; ++i) {
+        ring[i].mr = ring_mr;
+        ring[i].lkey = ring_mr->lkey;
+    }
+    memset(inflight, 0, sizeof(inflight));
 
-        DLOG(INFO) << "Initialize shm buffer";
-        shm_ring = ShmRpcRing::create(shm_key(ctx->my_ip, ctx->my_port, rpc_id), kRingElemCnt);
-        if (posix_memalign((void **)&shm_bufs, kCacheLineSize, sizeof(MsgBuf) * kRingElemCnt)) {
-            LOG(FATAL) << "Failed to allocate memory for shm buffers";
+    if (is_server) {
+        if (posix_memalign((void **)&resp_bufs, kCacheLineSize, ring_size)) {
+            LOG(FATAL) << "Failed to allocate memory for ring responses";
         }
-
-        for (int i = 0; i < kRingElemCnt; ++i) {
-            new (shm_bufs + i) MsgBufPair(shm_ring->get(i), i);
+        memset((void *)resp_bufs, 0, ring_size);
+        ibv_mr *resp_mr = rpc_ctx->ctx.createMR(resp_bufs, ring_size);
+        if (posix_memalign((void **)&pairs, kCacheLineSize, sizeof(MsgBufPair) * kRingSlots)) {
+            LOG(FATAL) << "Failed to allocate memory for ring pairs";
         }
-
-        for (int i = 0; i < Context::kQueueDepth; ++i) {
-            req_handle_free_queue.push(new ReqHandle);
+        for (int i = 0; i < kRingSlots; ++i) {
+            resp_bufs[i].mr = resp_mr;
+            resp_bufs[i].lkey = resp_mr->lkey;
+            new (pairs + i) MsgBufPair(&resp_bufs[i], &ring[i]);
         }
-
-        this->srv_srq = ctx->ctx.createSRQ(kSrvBufCnt);
-
-        postNextGroupRecv();
-        postNextGroupRecv();
-
-        ctx->ctx.mgr->srv_.bind("connect_" + std::to_string(rpc_id), [this](std::string ip, int port, int qp_id) {
-            LOG(INFO) << "conn " << ip << ":" << port << " " << qp_id;
-            auto qp = new QP;
-            *qp = this->ctx->ctx.createQP(IBV_QPT_RC, this->send_cq, this->recv_cq, this->srv_srq);
-            this->qpn_qp_map[qp->qp->qp_num] = { qp, 0, ip, port, qp_id };
-            qp->connect(ip, port, qp_id);
-            return qp->id;
-        });
-
-        LOG(INFO) << ctx->my_ip << ":" << ctx->my_port << " create rpc id " << rpc_id;
     }
 }
 
-RpcSession Rpc::connect(const std::string &ctx_ip, int ctx_port, int rmt_rpc_id) {
-    assert(!ctx->is_server);
-    RpcSession session;
-    memset(&session, 0, sizeof(RpcSession));
+RpcTransport Rpc::pickTransport(const std::string &ctx_ip, uint32_t msg_size_hint) {
+    if (ctx_ip == ctx->my_ip) {
+        return RpcTransport::kSHM;
+    }
+    // A few hot peers get a connection each, larger fan-out shares the UD QP.
+    if (rc_session_cnt < kAutoRCSessions) {
+        return msg_size_hint != 0 && msg_size_hint <= kAutoRingMaxSize ? RpcTransport::kRing : RpcTransport::kRC;
+    }
+    return RpcTransport::kUD;
+}
 
-    session.rpc = this;
-    if (ctx_ip == this->ctx->my_ip) {
-        // Same machine, use shared memory.
-        session.shm_ring = ShmRpcRing::open(shm_key(ctx_ip, ctx_port, rmt_rpc_id), kRingElemCnt);
-    } else {
-        ibv_cq *send_cq = ctx->ctx.createCQ();
-        ibv_cq *recv_cq = ctx->ctx.createCQ();
-        session.qp = { new QP, 0, ctx_ip, ctx_port, rmt_rpc_id };
-        *(session.qp.qp) = ctx->ctx.createQP(IBV_QPT_RC, send_cq, recv_cq);
-        // Exchange connection info.
-        int rmt_qp_id =
-            ctx->ctx.connect(ctx_ip, ctx_port)
-                ->cli_->call("connect_" + std::to_string(rmt_rpc_id), ctx->my_ip, ctx->my_port, session.qp.qp->id)
-                .as<int>();  // opposite connect me.
-        session.qp.qp->connect(ctx_ip, ctx_port, rmt_qp_id);
-        LOG(INFO) << "my ip: " << this->ctx->my_ip << ":" << ctx->my_port << " id " << session.qp.qp->id
-                  << " connect to " << ctx_ip << ":" << ctx_port << " rpc id " << rmt_rpc_id;
-        session.rmt_qp_id = rmt_qp_id;
+// A shared CQ must hold every completion its QPs can have outstanding, it grows by doubling.
+static void fitCQ(ibv_cq *cq, int cqe) {
+    if (cq->cqe >= cqe) return;
+    int ret = ibv_resize_cq(cq, std::max(cqe, cq->cqe * 2));
+    if (ret) {
+        LOG(ERROR) << "Resize CQ to " << cqe << " failed " << strerror(ret);
     }
-    return session;
 }
 
-void Rpc::send(RpcSession *session, uint8_t rpc_id, MsgBufPair *buf) {
-    assert(!ctx->is_server);
-    buf->session = session;
-    if (session->shm_ring != nullptr) {
-        uint64_t ticket = session->shm_ring->clientSend(rpc_id, buf->send_buf);
-        session->tickets.push_back(std::make_pair(session->shm_ring->get(ticket), buf));
+bool Rpc::connectRC(RpcSession *session, const std::string &ctx_ip, int ctx_port, int qp_id) {
+    if (rc_cli_send_cq == nullptr) {
+        rc_cli_send_cq = ctx->ctx.createCQ();
+        rc_cli_recv_cq = ctx->ctx.createCQ();
+    }
+
+    session->qp = new QPCnt{ new QP, 0, ctx_ip, ctx_port, qp_id };
+    // Two SGEs for multicast (header + shared payload).
+    *(session->qp->qp) =
+        ctx->ctx.createQP(IBV_QPT_RC, rc_cli_send_cq, rc_cli_recv_cq, nullptr, Context::kQueueDepth, 2);
+    // Exchange connection info.
+    int rmt_qp_id;
+    if (session->transport == RpcTransport::kRing) {
+        session->ring = new RingSession(ctx, false);
+        session->ring->qp = session->qp;
+        auto ret = ctx->ctx.connect(ctx_ip, ctx_port)
+                       ->cli_
+                       ->call("connect_ring_" + std::to_string(qp_id), ctx->my_ip, ctx->my_port,
+                              session->qp->qp->id, (uint64_t)session->ring->ring_mr->addr, session->ring->ring_mr->rkey)
+                       .as<std::vector<uint64_t>>();
+        if (ret.size() != 3) {
+            LOG(ERROR) << "Ring connection to " << ctx_ip << ":" << ctx_port << " rejected";
+            ibv_destroy_qp(session->qp->qp->qp);
+            return false;
+        }
+        rmt_qp_id = ret[0];
+        session->ring->rmt_addr = ret[1];
+        session->ring->rmt_rkey = ret[2];
+        cli_rings.push_back(session->ring);
     } else {
-        auto &sbuf = buf->send_buf;
-        auto &rbuf = buf->recv_buf;
-        session->qp.qp->recv((uint64_t)rbuf->buf, kMTU, rbuf->lkey, (uint64_t)buf);
-
-        // batch
-        if (++session->qp.send_cnt == Context::kQueueDepth) {
-            session->qp.qp->send((uint64_t)sbuf->buf, sbuf->size, sbuf->lkey, IBV_SEND_SIGNALED, true, rpc_id,
-                                 (uint64_t)buf);
-            session->qp.qp->pollSendCQ(1, wcs);
-            session->qp.send_cnt = 0;
-        } else {
-            session->qp.qp->send((uint64_t)sbuf->buf, sbuf->size, sbuf->lkey, 0, true, rpc_id, (uint64_t)buf);
+        rmt_qp_id = ctx->ctx.connect(ctx_ip, ctx_port)
+                        ->cli_->call("connect_" + std::to_string(qp_id), ctx->my_ip, ctx->my_port, session->qp->qp->id)
+                        .as<int>();  // opposite connect me.
+        if (rmt_qp_id < 0) {
+            LOG(ERROR) << "RC connection to " << ctx_ip << ":" << ctx_port << " rejected";
+            ibv_destroy_qp(session->qp->qp->qp);
+            return false;
         }
     }
+    // Posted before the QP is connected, a response finds them whatever the timing.
+    // Ring sessions only receive the messages too large for a slot, one per slot at most.
+    int recv_cnt = session->transport == RpcTransport::kRC ? Context::kQueueDepth : kRingSlots;
+    session->qp->recvs = new RCRecvBuf[recv_cnt];
+    session->qp->recv_cnt = recv_cnt;
+    for (int i = 0; i < recv_cnt; ++i) {
+        session->qp->recvs[i] = RCRecvBuf{ ctx->allocBuf(), session->qp };
+        rcPostRecv(&session->qp->recvs[i]);
+    }
+    session->qp->credits = recv_cnt;
+    rc_cli_recv_cnt += recv_cnt;
+    fitCQ(rc_cli_send_cq, (rc_session_cnt + 1) * kRCSignaledPerQP);
+    fitCQ(rc_cli_recv_cq, rc_cli_recv_cnt);
+    session->qp->qp->connect(ctx_ip, ctx_port, rmt_qp_id);
+    LOG(INFO) << "my ip: " << this->ctx->my_ip << ":" << ctx->my_port << " id " << session->qp->qp->id
+              << " connect to " << ctx_ip << ":" << ctx_port << " rpc id " << qp_id;
+    session->rmt_qp_id = rmt_qp_id;
+    ++rc_session_cnt;
+    return true;
 }
 
-bool Rpc::recv(MsgBufPair *msg, size_t retry_times) {
-    return msg->session->recv(msg, retry_times);
-}
-
-void Rpc::runServerLoopOnce() {
-    assert(ctx->is_server);
-    handleQPRequests();
-    handleSHMRequests();
+void Rpc::disconnectRC(RpcSession *session) {
+    QPCnt *qp_cnt = session->qp;
+    // Every request answered and its response released, the receives are idle then.
+    while (qp_cnt->credits != qp_cnt->recv_cnt) {
+        handleRCResponses();
+    }
+    // The shared send CQ keeps no completion naming this QPCnt.
+    while (qp_cnt->inflight != qp_cnt->send_cnt) {
+        pollRCSendCQ(rc_cli_send_cq);
+    }
+    ctx->ctx.connect(qp_cnt->oppo_ip, qp_cnt->oppo_port)
+        ->cli_->call("disconnect_" + std::to_string(qp_cnt->oppo_id), session->rmt_qp_id);
+    ibv_destroy_qp(qp_cnt->qp->qp);
+    for (int i = 0; i < qp_cnt->recv_cnt; ++i) {
+        ibv_dereg_mr(qp_cnt->recvs[i].buf->mr);
+        delete qp_cnt->recvs[i].buf;
+    }
+    delete[] qp_cnt->recvs;
+    rc_cli_recv_cnt -= qp_cnt->recv_cnt;
+    --rc_session_cnt;
+    if (session->ring != nullptr) {
+        cli_rings.erase(std::find(cli_rings.begin(), cli_rings.end(), session->ring));
+        ibv_dereg_mr(session->ring->ring_mr);
+        free(session->ring->ring);
+        delete session->ring;
+    }
+    delete qp_cnt->qp;
+    delete qp_cnt;
 }
 
-void Rpc::handleQPRequests() {
-    int finished = ibv_poll_cq(this->recv_cq, Context::kQueueDepth, wcs);
+// Retires the WRs of whichever QPs of the shared send CQ completed.
+void Rpc::pollRCSendCQ(ibv_cq *cq) {
+    ibv_wc wcs[Context::kQueueDepth];
+    int finished = ibv_poll_cq(cq, Context::kQueueDepth, wcs);
     for (int i = 0; i < finished; ++i) {
-        MsgBufPair *cur_pair = (MsgBufPair *)wcs[i].wr_id;
-        cur_pair->recv_buf->size = wcs[i].byte_len;
-        QPCnt &qp_cnt = qpn_qp_map[wcs[i].qp_num];
-        uint8_t rpc_id = wcs[i].imm_data;
-        DLOG(INFO) << "Got rpc " << (int)rpc_id << " from " << qp_cnt.oppo_ip << ":" << qp_cnt.oppo_port << " "
-                   << qp_cnt.oppo_id;
-
-        auto handle = req_handle_free_queue.pop();
-        *handle = ReqHandle{ this, cur_pair, &qp_cnt, ReqHandle::kQP };
-        ctx->funcs[rpc_id](handle, context);
+        if (unlikely(wcs[i].status != IBV_WC_SUCCESS)) {
+            LOG(ERROR) << "Send CQ completion with error: " << wcs[i].status << " ("
+                       << ibv_wc_status_str(wcs[i].status) << ")";
+        }
+        ((QPCnt *)wcs[i].wr_id)->inflight -= kRCSignalBatch;
     }
 }
 
-void Rpc::handleSHMRequests() {
-    while (shm_ring->serverTryRecv(shm_ticket)) {
-        ShmRpcRingSlot *slot = shm_ring->get(shm_ticket);
-
-        auto handle = req_handle_free_queue.pop();
-        *handle = ReqHandle{ this, &shm_bufs[shm_ticket % kRingElemCnt], nullptr, ReqHandle::kSHM };
-        ctx->funcs[slot->rpc_id](handle, context);
-        ++shm_ticket;
+int Rpc::reserveRC(QPCnt *qp_cnt) {
+    // A signaled WR is always pending when the QP is full.
+    while (unlikely(qp_cnt->inflight + 1 > Context::kQueueDepth)) {
+        pollRCSendCQ(qp_cnt->qp->qp->send_cq);
+    }
+    ++qp_cnt->inflight;
+    if (++qp_cnt->send_cnt == kRCSignalBatch) {
+        qp_cnt->send_cnt = 0;
+        return IBV_SEND_SIGNALED;
     }
+    return 0;
 }
 
-void Rpc::postNextGroupRecv() {
-    DLOG(INFO) << "postNextGroupRecv " << cur_group;
-    ibv_recv_wr *bad_wr;
-    ibv_post_srq_recv(this->srv_srq, srv_recv_wr_hdrs[cur_group], &bad_wr);
-    cur_group = (cur_group + 1) % kRecvWrGroupCnt;
+void Rpc::sendRC(RpcSession *session, MsgBufPair *buf, MsgBuf *payload) {
+    // At most one request in flight per posted receive, the others wait for responses to be released.
+    while (unlikely(session->qp->credits == 0)) {
+        handleRCResponses();
+    }
+    --session->qp->credits;
+    auto &sbuf = buf->send_buf;
+    trackSeq(sbuf->rpc_hdr.seq, buf);
+
+    QP *cur_qp = session->qp->qp;
+
+    int flags = reserveRC(session->qp);
+    if (payload == nullptr) {
+        cur_qp->send((uint64_t)&sbuf->rpc_hdr, sbuf->size + sizeof(RpcHeader), sbuf->lkey, flags, false, 0,
+                     (uint64_t)session->qp);
+        return;
+    }
+    // Header from sbuf, payload shared by a multicast.
+    ibv_sge sges[2];
+    sges[0] = { (uint64_t)&sbuf->rpc_hdr, sizeof(RpcHeader), sbuf->lkey };
+    sges[1] = { (uint64_t)payload->buf, payload->size, payload->lkey };
+    ibv_send_wr wr{}, *bad_wr;
+    wr.wr_id = (uint64_t)session->qp;
+    wr.sg_list = sges;
+    wr.num_sge = 2;
+    wr.opcode = IBV_WR_SEND;
+    wr.send_flags = flags;
+    int ret = ibv_post_send(cur_qp->qp, &wr, &bad_wr);
+    if (unlikely(ret)) {
+        LOG(ERROR) << "Post multicast send failed " << strerror(ret);
+    }
 }
 
-void RpcSession::send(uint8_t rpc_id, MsgBufPair *buf) {
-    rpc->send(this, rpc_id, buf);
+void Rpc::sendRing(RpcSession *session, MsgBufPair *buf) {
+    auto &sbuf = buf->send_buf;
+    if (unlikely(sbuf->size > kRingMaxMsgSize)) {
+        sendRC(session, buf);
+        return;
+    }
+    RingSession *ring = session->ring;
+    // Slot i is reused once the response of its previous request has arrived and is released.
+    // A credit keeps a receive for the response in case it doesn't fit the ring.
+    while (unlikely(ring->inflight[ring->head % kRingSlots] != nullptr || session->qp->credits == 0)) {
+        MsgBufPair *prev = ring->inflight[ring->head % kRingSlots];
+        if (prev != nullptr && prev->rx_ring == ring && prev->recv_buf == &ring->ring[ring->head % kRingSlots]) {
+            // The slot holds a response still being read, which may be the caller's.
+            sendRC(session, buf);
+            return;
+        }
+        handleRCResponses();
+    }
+    --session->qp->credits;
+    trackSeq(sbuf->rpc_hdr.seq, buf);
+    ringFormat(sbuf);
+    ring->inflight[ring->head % kRingSlots] = buf;
+    ring->seqs[ring->head % kRingSlots] = sbuf->rpc_hdr.seq;
+    uint64_t dest = ringSlotAddr(ring->rmt_addr, ring->head++);
+
+    int flags = reserveRC(session->qp);
+    session->qp->qp->write((uint64_t)ringHdr(sbuf), dest, ringMsgLen(sbuf->size), sbuf->lkey, ring->rmt_rkey, flags,
+                           (uint64_t)session->qp);
 }
 
-void RpcSession::handleQPResponses() {
-    // poll recv CQ.
-    if (qp.qp != nullptr) {
-        auto &wcs = rpc->wcs;
-        int finished = ibv_poll_cq(qp.qp->qp->recv_cq, Context::kQueueDepth, wcs);
+void Rpc::handleRCResponses() {
+    if (rc_cli_recv_cq != nullptr) {
+        pollRCSendCQ(rc_cli_send_cq);
+        // One CQ for all the RC sessions, seq identifies the request.
+        ibv_wc wcs[Context::kQueueDepth];
+        int finished = ibv_poll_cq(rc_cli_recv_cq, Context::kQueueDepth, wcs);
         for (int i = 0; i < finished; ++i) {
-            MsgBufPair *cur_pair = (MsgBufPair *)wcs[i].wr_id;
-            cur_pair->recv_buf->size = wcs[i].byte_len;
-            cur_pair->finished.store(true, std::memory_order_release);
+            RCRecvBuf *rx = (RCRecvBuf *)wcs[i].wr_id;
+            MsgBuf *rbuf = rx->buf;
+            rbuf->size = wcs[i].byte_len - sizeof(RpcHeader);
+            if (unlikely(rbuf->rpc_hdr.identifier.rpc_id == kRpcStreamChunk)) {
+                // Copied out, the receive is reposted within the credits of the stream.
+                onStreamChunk(rbuf);
+                rcPostRecv(rx);
+                continue;
+            }
+            auto seq = rbuf->rpc_hdr.seq;
+            MsgBufPair *pair = untrackResponse(seq);
+            if (unlikely(pair == nullptr || pair->session->ring != nullptr)) {
+                // A ring response too large for its slot, which is free again.
+                freeRingSlot(rx->qp, seq);
+            }
+            if (unlikely(pair == nullptr)) {
+                // Late, give the receive and its credit back.
+                rcPostRecv(rx);
+                ++rx->qp->credits;
+                continue;
+            }
+            pair->recv_buf = rbuf;
+            pair->rx_rc = rx;
+            completeResponse(pair);
         }
     }
-}
 
-void RpcSession::handleSHMResponses() {
-    if (shm_ring != nullptr) {
-        for (auto it = tickets.begin(); it != tickets.end();) {
-            auto &p = *it;
-            if (shm_ring->clientTryRecv(p.second->recv_buf, p.first)) {
-                p.second->finished.store(true, std::memory_order_release);
-                it = tickets.erase(it);
-            } else {
-                ++it;
+    for (RingSession *ring : cli_rings) {
+        for (uint64_t s = ring->tail; s < ring->head; ++s) {
+            int i = s % kRingSlots;
+            if (ring->inflight[i] == nullptr) continue;
+            MsgBuf *slot = &ring->ring[i];
+            if (ringPoll(slot)) {
+                MsgBufPair *pair = untrackResponse(ring->seqs[i]);
+                if (unlikely(pair == nullptr)) {
+                    // Late, free the slot.
+                    ring->inflight[i] = nullptr;
+                    ++ring->qp->credits;
+                    continue;
+                }
+                // The slot and its credit are held until releaseResponse().
+                pair->recv_buf = slot;
+                pair->rx_ring = ring;
+                completeResponse(pair);
             }
         }
+        while (ring->tail < ring->head && ring->inflight[ring->tail % kRingSlots] == nullptr) {
+            ++ring->tail;
+        }
     }
 }
 
-bool RpcSession::recv(MsgBufPair *msg, size_t retry_times) {
-    assert(!rpc->ctx->is_server);
-    for (size_t i = 0; i < retry_times; ++i) {
-        if (msg->finished) {
-            msg->finished = false;
-            return true;
+// Frees the ring slot of request seq on qp, if it is a ring request.
+void Rpc::freeRingSlot(QPCnt *qp, uint64_t seq) {
+    for (RingSession *ring : cli_rings) {
+        if (ring->qp != qp) continue;
+        for (int i = 0; i < kRingSlots; ++i) {
+            if (ring->inflight[i] != nullptr && ring->seqs[i] == seq) ring->inflight[i] = nullptr;
         }
-        handleQPResponses();
-        handleSHMResponses();
+        return;
     }
-    LOG(INFO) << "Possible packet loss... ip " << rpc->ctx->my_ip << " to " << msg->session->qp.oppo_ip
-              << this->rmt_qp_id;
-    return false;
 }
 
-void ReqHandle::response() {
-    if (type == kQP) {
-        auto &sbuf = buf->send_buf;
-        // sync -> batch, 800K -> 4M (reduce poll cq race)
-        QP *cur_qp = qp->qp;
-        if (++rpc->send_cnt >= Rpc::kRecvWrGroupSize) {
-            rpc->postNextGroupRecv();
-            rpc->send_cnt = 0;
+void Rpc::bindRC(int qp_id) {
+    std::lock_guard<std::mutex> lock(ctx->bind_mtx);
+    ctx->ctx.mgr->srv_.bind("connect_" + std::to_string(qp_id), [this](std::string ip, int port, int qp_id) {
+        LOG(INFO) << "conn " << ip << ":" << port << " " << qp_id;
+        setupRCServer();
+        auto qp = new QP;
+        *qp = this->ctx->ctx.createQP(IBV_QPT_RC, rc_send_cq, rc_recv_cq, rc_recv_pool->srq);
+        if (!addRCQP(new QPCnt{ qp, 0, ip, port, qp_id })) {
+            ibv_destroy_qp(qp->qp);
+            return -1;
+        }
+        qp->connect(ip, port, qp_id);
+        return qp->id;
+    });
+
+    ctx->ctx.mgr->srv_.bind("connect_ring_" + std::to_string(qp_id), [this](std::string ip, int port, int qp_id,
+                                                                           uint64_t rmt_addr, uint32_t rmt_rkey) {
+        LOG(INFO) << "ring conn " << ip << ":" << port << " " << qp_id;
+        setupRCServer();
+        int idx = this->ring_session_cnt.load(std::memory_order_acquire);
+        if (idx == kMaxRingSessions) {
+            LOG(ERROR) << "Too many ring sessions";
+            return std::vector<uint64_t>();
         }
+        auto qp = new QP;
+        *qp = this->ctx->ctx.createQP(IBV_QPT_RC, rc_send_cq, rc_recv_cq, rc_recv_pool->srq);
+        auto qp_cnt = new QPCnt{ qp, 0, ip, port, qp_id };
+        if (!addRCQP(qp_cnt)) {
+            ibv_destroy_qp(qp->qp);
+            return std::vector<uint64_t>();
+        }
+        auto ring = new RingSession(this->ctx, true);
+        ring->qp = qp_cnt;
+        ring->rmt_addr = rmt_addr;
+        ring->rmt_rkey = rmt_rkey;
+        qp->connect(ip, port, qp_id);
+        // Publish to the server loop, which may have closed sessions since idx was read.
+        std::lock_guard<std::mutex> lock(rc_mtx);
+        idx = this->ring_session_cnt.load(std::memory_order_relaxed);
+        this->ring_sessions[idx] = ring;
+        this->ring_session_cnt.store(idx + 1, std::memory_order_release);
+        return std::vector<uint64_t>{ (uint64_t)qp->id, (uint64_t)ring->ring_mr->addr, ring->ring_mr->rkey };
+    });
+
+    ctx->ctx.mgr->srv_.bind("disconnect_" + std::to_string(qp_id), [this](int rmt_qp_id) {
+        std::lock_guard<std::mutex> lock(rc_mtx);
+        for (int i = 0; i < kMaxRCQPs; ++i) {
+            QPCnt *qp_cnt = rc_qps[i].load(std::memory_order_relaxed);
+            if (qp_cnt != nullptr && qp_cnt->qp->id == rmt_qp_id) {
+                rc_closing.push_back(qp_cnt);
+                rc_has_closing.store(true, std::memory_order_release);
+                return;
+            }
+        }
+        LOG(ERROR) << "Disconnect of unknown RC QP " << rmt_qp_id;
+    });
+}
 
-        if (++qp->send_cnt >= Context::kQueueDepth) {
-            cur_qp->send((uint64_t)sbuf->buf, sbuf->size, sbuf->lkey, IBV_SEND_SIGNALED);
-            ibv_wc wc;
-            cur_qp->pollSendCQ(1, &wc);
-            qp->send_cnt = 0;
+void Rpc::closeRCQPs() {
+    std::lock_guard<std::mutex> lock(rc_mtx);
+    for (auto it = rc_closing.begin(); it != rc_closing.end();) {
+        QPCnt *qp_cnt = *it;
+        if (qp_cnt->inflight != qp_cnt->send_cnt) {
+            ++it;
+            continue;
+        }
+        // Backward shift deletion keeps the probe sequences of the other QPs whole.
+        uint32_t i = qp_cnt->qp->qp->qp_num & (kMaxRCQPs - 1);
+        while (rc_qps[i].load(std::memory_order_relaxed) != qp_cnt) {
+            i = (i + 1) & (kMaxRCQPs - 1);
+        }
+        for (uint32_t j = (i + 1) & (kMaxRCQPs - 1);; j = (j + 1) & (kMaxRCQPs - 1)) {
+            QPCnt *next = rc_qps[j].load(std::memory_order_relaxed);
+            if (next == nullptr) break;
+            uint32_t home = next->qp->qp->qp_num & (kMaxRCQPs - 1);
+            // next may fill the hole at i unless its home lies in (i, j].
+            if (((j - home) & (kMaxRCQPs - 1)) >= ((j - i) & (kMaxRCQPs - 1))) {
+                rc_qps[i].store(next, std::memory_order_release);
+                i = j;
+            }
+        }
+        rc_qps[i].store(nullptr, std::memory_order_release);
+        --rc_qp_cnt;
+
+        int n = ring_session_cnt.load(std::memory_order_relaxed);
+        for (int s = 0; s < n; ++s) {
+            RingSession *ring = ring_sessions[s];
+            if (ring->qp != qp_cnt) continue;
+            ring_sessions[s] = ring_sessions[n - 1];
+            ring_session_cnt.store(n - 1, std::memory_order_release);
+            ibv_dereg_mr(ring->resp_bufs[0].mr);
+            ibv_dereg_mr(ring->ring_mr);
+            free(ring->resp_bufs);
+            free(ring->pairs);
+            free(ring->ring);
+            delete ring;
+            break;
+        }
+        ibv_destroy_qp(qp_cnt->qp->qp);
+        delete qp_cnt->qp;
+        delete qp_cnt;
+        it = rc_closing.erase(it);
+    }
+    rc_has_closing.store(!rc_closing.empty(), std::memory_order_release);
+}
+
+void Rpc::setupRCServer() {
+    // Most servers never see an RC session, so its buffers are only allocated here.
+    std::lock_guard<std::mutex> lock(rc_mtx);
+    if (rc_recv_pool != nullptr) return;
+    rc_send_cq = ctx->ctx.createCQ(kMaxRCQPs / 2 * kRCSignaledPerQP);
+    rc_recv_cq = ctx->ctx.createCQ(kRCSrvBufCnt);
+    rc_recv_pool = new RecvPool(ctx, kRCSrvBufCnt, kRecvWrGroupCnt, true, false);
+    rc_recv_pool->postAll();
+    rc_ready.store(true, std::memory_order_release);
+}
+
+bool Rpc::addRCQP(QPCnt *qp_cnt) {
+    std::lock_guard<std::mutex> lock(rc_mtx);
+    if (rc_qp_cnt == kMaxRCQPs / 2) {
+        // Half full keeps the probing short, and the shared send CQ is sized for that many.
+        LOG(ERROR) << "Too many RC QPs, at most " << kMaxRCQPs / 2;
+        return false;
+    }
+    ++rc_qp_cnt;
+    uint32_t i = qp_cnt->qp->qp->qp_num & (kMaxRCQPs - 1);
+    while (rc_qps[i].load(std::memory_order_relaxed) != nullptr) {
+        i = (i + 1) & (kMaxRCQPs - 1);
+    }
+    rc_qps[i].store(qp_cnt, std::memory_order_release);
+    return true;
+}
+
+int Rpc::handleRCRequests() {
+    if (!rc_ready.load(std::memory_order_acquire)) return 0;
+    pollRCSendCQ(rc_send_cq);
+    if (unlikely(rc_has_closing.load(std::memory_order_acquire))) closeRCQPs();
+
+    ibv_wc wcs[Context::kQueueDepth];
+    int finished = ibv_poll_cq(rc_recv_cq, Context::kQueueDepth, wcs);
+    for (int i = 0; i < finished; ++i) {
+        MsgBufPair *cur_pair = (MsgBufPair *)wcs[i].wr_id;
+        cur_pair->recv_buf->size = wcs[i].byte_len - sizeof(RpcHeader);
+        QPCnt *qp_cnt = findRCQP(wcs[i].qp_num);
+        uint8_t rpc_id = cur_pair->recv_buf->rpc_hdr.identifier.rpc_id;
+        cur_pair->send_buf->rpc_hdr.seq = cur_pair->recv_buf->rpc_hdr.seq;
+        cur_pair->send_buf->rpc_hdr.identifier = this->identifier;
+        cur_pair->send_buf->rpc_hdr.identifier.rpc_id = kRpcResponse;
+        DLOG(INFO) << "Got rpc " << (int)rpc_id << " from " << qp_cnt->oppo_ip << ":" << qp_cnt->oppo_port << " "
+                   << qp_cnt->oppo_id;
+
+        auto handle = ReqHandle{ this, cur_pair, nullptr, 0, ReqHandle::kRC, rpc_id };
+        handle.rc_qp = qp_cnt;
+        if (unlikely(rpc_id == kRpcStreamAck)) {
+            onStreamAck(cur_pair->recv_buf);
+        } else if (unlikely(ctx->streamed[rpc_id])) {
+            startStream(handle);
         } else {
-            cur_qp->send((uint64_t)sbuf->buf, sbuf->size, sbuf->lkey, 0);
+            ctx->invoke(rpc_id, &handle, context);
         }
-    } else {
-        assert(type == kSHM);
-        rpc->shm_ring->serverSend(this->buf->ticket);
+        rc_recv_pool->release(cur_pair);
+    }
+
+    int n = ring_session_cnt.load(std::memory_order_acquire);
+    for (int s = 0; s < n; ++s) {
+        RingSession *ring = ring_sessions[s];
+        // Requests of a session land in order.
+        while (true) {
+            int i = ring->head % kRingSlots;
+            MsgBuf *slot = &ring->ring[i];
+            if (!ringPoll(slot)) break;
+            ++ring->head;
+            ++finished;
+            MsgBufPair *pair = &ring->pairs[i];
+            uint8_t rpc_id = slot->rpc_hdr.identifier.rpc_id;
+            pair->send_buf->rpc_hdr.seq = slot->rpc_hdr.seq;
+            pair->send_buf->rpc_hdr.identifier = this->identifier;
+            pair->send_buf->rpc_hdr.identifier.rpc_id = kRpcResponse;
+
+            auto handle = ReqHandle{ this, pair, nullptr, 0, ReqHandle::kRing, rpc_id };
+            handle.rc_qp = ring->qp;
+            handle.ring = ring;
+            ctx->invoke(rpc_id, &handle, context);
+        }
+    }
+    return finished;
+}
+
+void Rpc::postRCResponse(QPCnt *qp_cnt, MsgBuf *sbuf) {
+    int flags = reserveRC(qp_cnt);
+    qp_cnt->qp->send((uint64_t)&sbuf->rpc_hdr, sbuf->size + sizeof(RpcHeader), sbuf->lkey, flags, false, 0,
+                     (uint64_t)qp_cnt);
+}
+
+void Rpc::postRingResponse(RingSession *ring, MsgBufPair *pair) {
+    // Into the client's ring, at the slot of the request.
+    auto &sbuf = pair->send_buf;
+    if (unlikely(sbuf->size > kRingMaxMsgSize)) {
+        // No room for the canary, the client has a receive posted for it.
+        postRCResponse(ring->qp, sbuf);
+        return;
     }
-    rpc->req_handle_free_queue.push(this);
+    ringFormat(sbuf);
+    uint64_t dest = ringSlotAddr(ring->rmt_addr, pair - ring->pairs);
+    int flags = reserveRC(ring->qp);
+    ring->qp->qp->write((uint64_t)ringHdr(sbuf), dest, ringMsgLen(sbuf->size), sbuf->lkey, ring->rmt_rkey, flags,
+                        (uint64_t)ring->qp);
 }
 
 }  // namespace rdma
@@ -1,5 +1,7 @@
 #include "rdma/rpc.h"
 
+#include <numa.h>
+
 #include "utils/defs.h"
 
 namespace rdma {
@@ -27,71 +29,153 @@ MsgBuf *RpcContext::allocBuf() {
     return buf;
 }
 
-Rpc::Rpc(RpcContext *rpc_ctx, void *context, int qp_id) : ctx(rpc_ctx), context(context), conn_buf(rpc_ctx) {
-    identifier.ctx_id = ctx->id;
-    identifier.qp_id = qp_id;
-    send_cnt = cur_group = 0;
-    ibv_cq *send_cq = rpc_ctx->ctx.createCQ();
-    ibv_cq *recv_cq = rpc_ctx->ctx.createCQ();
-    qp = rpc_ctx->ctx.createQP(qp_id, IBV_QPT_UD, send_cq, recv_cq);
-    qp.modifyToRTS(false);
-
-    if (posix_memalign((void **)&srv_bufs, kCacheLineSize, sizeof(MsgBufPair) * kSrvBufCnt)) {
+RecvPool::RecvPool(RpcContext *rpc_ctx, int buf_cnt, int group_cnt, bool use_srq, bool ud)
+    : buf_cnt(buf_cnt), group_cnt(group_cnt), group_size(buf_cnt / group_cnt) {
+    if (buf_cnt % group_cnt != 0) {
+        LOG(FATAL) << "Recv buffer count " << buf_cnt << " is not a multiple of group count " << group_cnt;
+    }
+    if (posix_memalign((void **)&bufs, kCacheLineSize, sizeof(MsgBufPair) * buf_cnt)) {
         LOG(FATAL) << "Failed to allocate memory for server buffers";
     }
-    for (int i = 0; i < kSrvBufCnt; ++i) {
-        new (srv_bufs + i) MsgBufPair(rpc_ctx, true);
+    for (int i = 0; i < buf_cnt; ++i) {
+        new (bufs + i) MsgBufPair(rpc_ctx, true);
     }
 
-    // All the recv bufs are managed by server.
-    srv_recv_sges = new ibv_sge[kSrvBufCnt];
-    srv_recv_wrs = new ibv_recv_wr[kSrvBufCnt];
-    for (int gi = 0; gi < kRecvWrGroupCnt; ++gi) {
-        int start = gi * kRecvWrGroupSize;
+    sges = new ibv_sge[buf_cnt];
+    wrs = new ibv_recv_wr[buf_cnt];
+    done = new std::atomic<int>[group_cnt];
+    for (int gi = 0; gi < group_cnt; ++gi) {
+        int start = gi * group_size;
         // Chained.
-        int end = start + kRecvWrGroupSize;
+        int end = start + group_size;
         for (int i = start; i < end; ++i) {
-            srv_recv_sges[i].addr = (uint64_t)srv_bufs[i].recv_buf->hdr;
-            srv_recv_sges[i].length = kMTU;
-            srv_recv_sges[i].lkey = srv_bufs[i].recv_buf->lkey;
-            srv_recv_wrs[i].wr_id = (uint64_t)&srv_bufs[i];
-            srv_recv_wrs[i].next = i == end - 1 ? nullptr : &srv_recv_wrs[i + 1];
-            srv_recv_wrs[i].num_sge = 1;
-            srv_recv_wrs[i].sg_list = &srv_recv_sges[i];
+            sges[i].addr = ud ? (uint64_t)bufs[i].recv_buf->hdr : (uint64_t)&bufs[i].recv_buf->rpc_hdr;
+            sges[i].length = kMTU;
+            sges[i].lkey = bufs[i].recv_buf->lkey;
+            wrs[i].wr_id = (uint64_t)&bufs[i];
+            wrs[i].next = i == end - 1 ? nullptr : &wrs[i + 1];
+            wrs[i].num_sge = 1;
+            wrs[i].sg_list = &sges[i];
         }
-        srv_recv_wr_hdrs[gi] = &srv_recv_wrs[start];
+        done[gi].store(0, std::memory_order_relaxed);
+    }
+    if (use_srq) {
+        srq = rpc_ctx->ctx.createSRQ(buf_cnt);
     }
-    postNextGroupRecv();
-    postNextGroupRecv();
+}
 
-    if (posix_memalign((void **)&srv_shm_bufs, kCacheLineSize, sizeof(MsgBuf *) * kSrvBufCnt)) {
-        LOG(FATAL) << "Failed to allocate memory for server shm buffers";
+void RecvPool::postGroup(int group) {
+    DLOG(INFO) << "postGroup " << group;
+    ibv_recv_wr *bad_wr;
+    int ret = srq != nullptr ? ibv_post_srq_recv(srq, &wrs[group * group_size], &bad_wr)
+                             : ibv_post_recv(qp, &wrs[group * group_size], &bad_wr);
+    if (unlikely(ret)) {
+        LOG(ERROR) << "Post recv group " << group << " failed " << strerror(ret);
     }
+}
 
-    for (int i = 0; i < kSrvBufCnt; ++i) {
-        srv_shm_bufs[i] = rpc_ctx->allocBuf();
+void RecvPool::postAll() {
+    for (int gi = 0; gi < group_cnt; ++gi) {
+        postGroup(gi);
+    }
+}
+
+Rpc::Rpc(RpcContext *rpc_ctx, void *context, int qp_id, int recv_buf_cnt, int recv_group_cnt, bool shared_recv)
+    : ctx(rpc_ctx), context(context), conn_buf(rpc_ctx) {
+    identifier.ctx_id = ctx->id;
+    identifier.qp_id = qp_id;
+
+    // All the recv bufs are managed by server.
+    bool fresh_pool = true;
+    if (shared_recv) {
+        std::lock_guard<std::mutex> lock(rpc_ctx->shared_recv_pool_mtx);
+        if (rpc_ctx->shared_recv_pool == nullptr) {
+            rpc_ctx->shared_recv_pool = new RecvPool(rpc_ctx, recv_buf_cnt, recv_group_cnt, true);
+        } else {
+            fresh_pool = false;
+        }
+        recv_pool = rpc_ctx->shared_recv_pool;
+    } else {
+        recv_pool = new RecvPool(rpc_ctx, recv_buf_cnt, recv_group_cnt, false);
+    }
+
+    // The recv CQ should hold a completion for every buffer of the pool.
+    int recv_depth = std::max(recv_pool->buf_cnt, (int)Context::kQueueDepth);
+    ibv_cq *send_cq = rpc_ctx->ctx.createCQ();
+    ibv_cq *recv_cq = rpc_ctx->ctx.createCQ(recv_depth);
+    // Two SGEs for multicast (header + shared payload).
+    qp = rpc_ctx->ctx.createQP(qp_id, IBV_QPT_UD, send_cq, recv_cq, recv_pool->srq, recv_depth, 2);
+    qp.modifyToRTS(false);
+    if (recv_pool->srq == nullptr) {
+        recv_pool->qp = qp.qp;
+    }
+    if (fresh_pool) {
+        recv_pool->postAll();
     }
-    srv_shm_buf_idx = 0;
 
     if (ctx->is_server) {
         DLOG(INFO) << "Initialize shm buffer";
-        shm_ring = ShmRpcRing::create(shm_key(ctx->my_ip, ctx->my_port, qp_id), kRingElemCnt);
+        ShmRingOptions opts;
+        opts.huge_pages = true;
+        opts.numa = ctx->numa;
+        opts.prefault_threads = kShmPrefaultThreads;
+        shm_ring = ShmRpcRing::create(shm_key(ctx->my_ip, ctx->my_port, qp_id), kRingElemCnt, kShmArenaSize, opts);
         if (posix_memalign((void **)&shm_bufs, kCacheLineSize, sizeof(MsgBuf) * kRingElemCnt)) {
             LOG(FATAL) << "Failed to allocate memory for shm buffers";
         }
 
         for (int i = 0; i < kRingElemCnt; ++i) {
-            new (shm_bufs + i) MsgBufPair(shm_ring->get(i), i);
+            // Pointed at the messages of each request.
+            new (shm_bufs + i) MsgBufPair(nullptr, nullptr);
+            shm_bufs[i].ticket = i;
         }
+        shm_scratch.resize(kRingElemCnt, nullptr);
+
+        bindRC(qp_id);
+        registerLocal();
     }
 }
 
-RpcSession Rpc::connect(const std::string &ctx_ip, int ctx_port, int qp_id) {
+Rpc::~Rpc() {
+    if (ctx->is_server) unregisterLocal();
+}
+
+RpcSession Rpc::connect(const std::string &ctx_ip, int ctx_port, int qp_id, RpcTransport transport,
+                        uint32_t msg_size_hint) {
+    Rpc *local_server = nullptr;
+    if (transport == RpcTransport::kAuto || transport == RpcTransport::kLocal) {
+        local_server = findLocal(ctx_ip, ctx_port, qp_id);
+        if (local_server != nullptr) {
+            transport = RpcTransport::kLocal;
+        } else if (transport == RpcTransport::kLocal) {
+            LOG(ERROR) << "No server " << ctx_ip << ":" << ctx_port << " " << qp_id << " in this process";
+            return RpcSession();
+        } else {
+            transport = pickTransport(ctx_ip, msg_size_hint);
+        }
+    }
     RpcSession session;
-    if (ctx_ip == this->ctx->my_ip) {
+    session.rpc = this;
+    session.transport = transport;
+    if (transport == RpcTransport::kLocal) {
+        if (!connectLocal(&session, local_server)) return RpcSession();
+    } else if (transport == RpcTransport::kSHM) {
         // Same machine, use shared memory.
-        session.rpc = this;
-        session.shm_ring = ShmRpcRing::open(shm_key(ctx_ip, ctx_port, qp_id), kRingElemCnt);
+        if (ctx_ip != this->ctx->my_ip) {
+            LOG(ERROR) << "Shm transport to remote " << ctx_ip;
+            return RpcSession();
+        }
+        session.shm_ring = ShmRpcRing::open(shm_key(ctx_ip, ctx_port, qp_id), kRingElemCnt, kShmArenaSize);
+        session.shm_lane = session.shm_ring->registerLane();
+        if (session.shm_lane < 0) {
+            LOG(ERROR) << "Too many clients on shm ring " << ctx_ip << ":" << ctx_port << " " << qp_id << ", at most "
+                       << ShmRpcRing::kMaxLanes;
+            return RpcSession();
+        }
+        session.shm_pending = new ShmPending(session.shm_ring, session.shm_lane);
+        shm_pendings.push_back(session.shm_pending);
+    } else if (transport == RpcTransport::kRC || transport == RpcTransport::kRing) {
+        if (!connectRC(&session, ctx_ip, ctx_port, qp_id)) return RpcSession();
     } else {
         // Exchange connection info.
         std::string qp_info_str((char *)(&qp.info), sizeof(QPInfo));
@@ -100,64 +184,318 @@ RpcSession Rpc::connect(const std::string &ctx_ip, int ctx_port, int qp_id) {
         QPInfo qp_info = ctx->ctx.getQPInfo(ctx_ip, ctx_port, qp_id);
         ibv_ah_attr ah_attr;
         ctx->ctx.fillAhAttr(&ah_attr, qp_info);
-        session.rpc = this;
         session.ah = ibv_create_ah(ctx->ctx.pd, &ah_attr);
         session.qpn = qp_info.qpn;
         // Invalidate server-side cache.
         std::lock_guard<std::mutex> lock(conn_buf_mtx);
         this->send(&session, kRpcNewConnection, &conn_buf);
         this->recv(&conn_buf, 1000000000);
+        releaseResponse(&conn_buf);
+    }
+    return session;
+}
+
+void Rpc::disconnect(RpcSession *session) {
+    if (session->transport == RpcTransport::kSHM) {
+        ShmPending *p = session->shm_pending;
+        while (p->head != p->tail) {
+            handleSHMResponses();
+        }
+        ShmRpcLane &l = session->shm_ring->lanes[session->shm_lane];
+        if (l.free_ticket_ == l.ticket_) {
+            session->shm_ring->unregisterLane(session->shm_lane);
+        } else {
+            LOG(ERROR) << "reserveSHM pairs of shm lane " << session->shm_lane << " not released, the lane is lost";
+        }
+        shm_pendings.erase(std::find(shm_pendings.begin(), shm_pendings.end(), p));
+        delete p;
+    } else if (session->transport == RpcTransport::kLocal) {
+        disconnectLocal(session);
+    } else if (session->transport == RpcTransport::kRC || session->transport == RpcTransport::kRing) {
+        disconnectRC(session);
+    }
+    *session = RpcSession();
+}
+
+// splitmix64 finalizer.
+static inline uint64_t mix64(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+RpcSession Rpc::connectEndpoint(const std::string &ctx_ip, int ctx_port, int ep_qp_id, bool per_request) {
+    // Blocking until the endpoint is published.
+    std::string n_workers_str;
+    while (n_workers_str.empty()) {
+        n_workers_str = ctx->ctx.connect(ctx_ip, ctx_port)->get(ep_key(ep_qp_id));
+    }
+    int n_workers = std::stoi(n_workers_str);
+    int worker = mix64(identifier.raw + session_cnt++) % n_workers;
+    if (ctx_ip == this->ctx->my_ip) {
+        // Same machine, one ring per session.
+        return connect(ctx_ip, ctx_port, ep_qp_id + worker);
+    }
+
+    RpcSession session;
+    std::string qp_info_str((char *)(&qp.info), sizeof(QPInfo));
+    ctx->ctx.put(ctx_ip, ctx_port, identifier.key(), qp_info_str);
+
+    // Workers share the context of the endpoint, hence a single AH.
+    session.rpc = this;
+    for (int i = 0; i < n_workers; ++i) {
+        QPInfo qp_info = ctx->ctx.getQPInfo(ctx_ip, ctx_port, ep_qp_id + i);
+        if (session.ah == nullptr) {
+            ibv_ah_attr ah_attr;
+            ctx->ctx.fillAhAttr(&ah_attr, qp_info);
+            session.ah = ibv_create_ah(ctx->ctx.pd, &ah_attr);
+        }
+        session.worker_qpns.push_back(qp_info.qpn);
+    }
+
+    // Invalidate server-side cache of every worker.
+    std::lock_guard<std::mutex> lock(conn_buf_mtx);
+    for (int i = 0; i < n_workers; ++i) {
+        session.qpn = session.worker_qpns[i];
+        this->send(&session, kRpcNewConnection, &conn_buf);
+        this->recv(&conn_buf, 1000000000);
+        releaseResponse(&conn_buf);
     }
+    session.qpn = session.worker_qpns[worker];
+    session.per_request = per_request;
     return session;
 }
-void Rpc::send(RpcSession *session, uint8_t rpc_id, MsgBufPair *buf) {
+
+// Shm and in-process responses are written in the pair's own buffer: no other request in flight shares it.
+static inline MsgBuf *ownRecvBuf(MsgBufPair *buf) {
+    if (unlikely(buf->own_recv == nullptr)) buf->own_recv = new MsgBuf;
+    return buf->own_recv;
+}
+
+bool Rpc::send(RpcSession *session, uint8_t rpc_id, MsgBufPair *buf) {
+    releaseResponse(buf);
     buf->session = session;
-    if (session->shm_ring != nullptr) {
-        buf->recv_buf = this->srv_shm_bufs[this->srv_shm_buf_idx];
-        this->srv_shm_buf_idx = (this->srv_shm_buf_idx + 1) % kSrvBufCnt;
-        uint64_t ticket = session->shm_ring->clientSend(rpc_id, buf->send_buf);
-        session->tickets.push_back(std::make_pair(session->shm_ring->get(ticket), buf));
+    if (session->transport == RpcTransport::kSHM) {
+        if (unlikely(!session->shm_ring->clientFits(buf->send_buf->size, session->shm_resp_cap))) {
+            LOG(ERROR) << "shm request of " << buf->send_buf->size << " bytes with " << session->shm_resp_cap
+                       << " bytes of response room doesn't fit a lane";
+            return false;
+        }
+        buf->recv_buf = ownRecvBuf(buf);
+        uint64_t ticket;
+        ShmRpcRingSlot *slot;
+        while ((slot = session->shm_ring->clientTrySend(session->shm_lane, rpc_id, buf->send_buf,
+                                                        session->shm_resp_cap, &ticket)) == nullptr) {
+            // The lane is full, responses free it.
+            handleSHMResponses();
+        }
+        buf->ticket = ticket;
+        trackSHM(session, ticket, buf);
+    } else if (session->transport == RpcTransport::kLocal) {
+        buf->recv_buf = ownRecvBuf(buf);
+        buf->send_buf->rpc_hdr = session->rpcHeader(rpc_id);
+        sendLocal(session, buf);
+    } else if (session->transport == RpcTransport::kRC) {
+        buf->send_buf->rpc_hdr = session->rpcHeader(rpc_id);
+        sendRC(session, buf);
+    } else if (session->transport == RpcTransport::kRing) {
+        buf->send_buf->rpc_hdr = session->rpcHeader(rpc_id);
+        sendRing(session, buf);
     } else {
         auto &sbuf = buf->send_buf;
         // fill header and seq.
         sbuf->rpc_hdr = session->rpcHeader(rpc_id);
 
         // maintain maps.
-        this->seq_buf_map.insert(std::make_pair(sbuf->rpc_hdr.seq, buf));
+        trackSeq(sbuf->rpc_hdr.seq, buf);
         DLOG(INFO) << "Send with identifier " << sbuf->rpc_hdr.identifier.ctx_id << " "
                    << sbuf->rpc_hdr.identifier.qp_id << " " << (int)sbuf->rpc_hdr.identifier.rpc_id << " seq "
                    << sbuf->rpc_hdr.seq << " " << my_thread_id;
 
-        if (++send_cnt >= Rpc::kRecvWrGroupSize) {
-            qp.send((uint64_t)&sbuf->rpc_hdr, sbuf->size + sizeof(RpcHeader), sbuf->lkey, session->ah, session->qpn,
-                    IBV_SEND_SIGNALED);
-            ibv_wc wc;
-            qp.pollSendCQ(1, &wc);
-            send_cnt = 0;
+        reserveSendQueue(1);
+        sq_pairs[(sq_head + sq_inflight) % Context::kQueueDepth] = nullptr;
+        ++sq_inflight;
+        if (++sq_unsignaled >= Rpc::kRecvWrGroupSize) {
+            qp.send((uint64_t)&sbuf->rpc_hdr, sbuf->size + sizeof(RpcHeader), sbuf->lkey, session->ah,
+                    session->destQPN(sbuf->rpc_hdr.seq), IBV_SEND_SIGNALED, false, 0, sq_unsignaled);
+            sq_unsignaled = 0;
         } else {
-            qp.send((uint64_t)&sbuf->rpc_hdr, sbuf->size + sizeof(RpcHeader), sbuf->lkey, session->ah, session->qpn);
+            qp.send((uint64_t)&sbuf->rpc_hdr, sbuf->size + sizeof(RpcHeader), sbuf->lkey, session->ah,
+                    session->destQPN(sbuf->rpc_hdr.seq));
         }
     }
+    return true;
 }
 
-void Rpc::handleSHMResponses(RpcSession *session) {
-    if (session->shm_ring != nullptr) {
-        for (auto it = session->tickets.begin(); it != session->tickets.end();) {
-            auto &p = *it;
-            if (session->shm_ring->clientTryRecv(p.second->recv_buf, p.first)) {
-                p.second->finished.store(true, std::memory_order_release);
-                it = session->tickets.erase(it);
-            } else {
-                ++it;
+void Rpc::multicast(RpcSession **sessions, int k, uint8_t rpc_id, MsgBuf *payload, MsgBufPair **bufs) {
+    for (int i = 0; i < k; ++i) {
+        RpcSession *session = sessions[i];
+        MsgBufPair *buf = bufs[i];
+        buf->finished.store(false, std::memory_order_relaxed);
+        releaseResponse(buf);
+        if (session->transport == RpcTransport::kUD) {
+            buf->session = session;
+            auto &sbuf = buf->send_buf;
+            sbuf->rpc_hdr = session->rpcHeader(rpc_id);
+            trackSeq(sbuf->rpc_hdr.seq, buf);
+            stageSend(sbuf, session->ah, session->destQPN(sbuf->rpc_hdr.seq), payload);
+        } else if (session->transport == RpcTransport::kRC) {
+            buf->session = session;
+            buf->send_buf->rpc_hdr = session->rpcHeader(rpc_id);
+            sendRC(session, buf, payload);
+        } else {
+            memcpy(buf->send_buf->buf, payload->buf, payload->size);
+            buf->send_buf->size = payload->size;
+            send(session, rpc_id, buf);
+        }
+    }
+    flushResponses();
+}
+
+bool Rpc::gather(MsgBufPair **bufs, int k, int quorum, size_t retry_times) {
+    bool reached = false;
+    for (size_t i = 0; i < retry_times && !reached; ++i) {
+        int done = 0;
+        for (int j = 0; j < k; ++j) {
+            done += bufs[j]->finished.load(std::memory_order_acquire);
+        }
+        reached = done >= quorum;
+        if (!reached) poll();
+    }
+    for (int j = 0; j < k; ++j) {
+        if (!bufs[j]->finished.load(std::memory_order_acquire) && bufs[j]->session->transport != RpcTransport::kLocal) {
+            cancel(bufs[j]);
+        }
+    }
+    return reached;
+}
+
+void Rpc::cancel(MsgBufPair *buf) {
+    buf->callback = nullptr;
+    RpcSession *session = buf->session;
+    if (session->transport == RpcTransport::kSHM) {
+        // The slot is released when the response comes, see completeSHM.
+        ShmPending *p = session->shm_pending;
+        if (p->bufs[buf->ticket % p->n] == buf) p->bufs[buf->ticket % p->n] = nullptr;
+    } else if (session->transport != RpcTransport::kLocal) {
+        uint64_t seq = buf->send_buf->rpc_hdr.seq;
+        if (seq_bufs[seq & (kMaxInflight - 1)] == buf) untrackSeq(seq);
+    }
+}
+
+MsgBufPair *Rpc::reserveSHM(RpcSession *session, uint32_t req_cap, uint32_t resp_cap) {
+    assert(session->transport == RpcTransport::kSHM);
+    MsgBufPair *buf;
+    if (free_shm_pairs.empty()) {
+        buf = new MsgBufPair(nullptr, nullptr);
+    } else {
+        buf = free_shm_pairs.back();
+        free_shm_pairs.pop_back();
+    }
+    ShmRpcRing *ring = session->shm_ring;
+    if (unlikely(!ring->clientFits(req_cap, resp_cap))) {
+        LOG(ERROR) << "shm request of " << req_cap << " bytes with " << resp_cap
+                   << " bytes of response room doesn't fit a lane";
+        free_shm_pairs.push_back(buf);
+        return nullptr;
+    }
+    ShmRpcRingSlot *slot;
+    while ((slot = ring->clientTryReserve(session->shm_lane, req_cap, resp_cap, &buf->ticket)) == nullptr) {
+        handleSHMResponses();
+    }
+    buf->send_buf = ring->reqBuf(slot);
+    buf->send_buf->size = 0;
+    buf->recv_buf = ring->respBuf(slot);
+    buf->session = session;
+    // Tracked in ticket order, it's not finished before the commit.
+    trackSHM(session, buf->ticket, buf);
+    return buf;
+}
+
+void Rpc::sendSHM(MsgBufPair *buf, uint8_t rpc_id) {
+    ShmRpcRingSlot *slot = buf->session->shm_ring->get(buf->session->shm_lane, buf->ticket);
+    buf->session->shm_ring->clientCommit(slot, rpc_id);
+}
+
+void Rpc::releaseSHM(MsgBufPair *buf) {
+    RpcSession *session = buf->session;
+    session->shm_ring->clientRelease(session->shm_lane, session->shm_ring->get(session->shm_lane, buf->ticket));
+    free_shm_pairs.push_back(buf);
+}
+
+bool Rpc::completeSHM(ShmPending *p, uint64_t ticket) {
+    MsgBufPair *buf = p->bufs[ticket % p->n];
+    ShmRpcRingSlot *slot = p->ring->get(p->lane, ticket);
+    bool done;
+    if (unlikely(buf == nullptr || buf->ticket != ticket || buf->session->shm_pending != p)) {
+        // Cancelled or sent again, the response is dropped.
+        buf = nullptr;
+        done = p->ring->clientTryPoll(slot);
+        if (done) p->ring->clientRelease(p->lane, slot);
+    } else {
+        // In place for reserveSHM pairs, the slot is released by releaseSHM.
+        done = buf->recv_buf == p->ring->respBuf(slot) ? p->ring->clientTryPoll(slot)
+                                                       : p->ring->clientTryRecv(p->lane, buf->recv_buf, slot);
+    }
+    if (done) {
+        if (ticket == p->head) {
+            ++p->head;
+        } else {
+            p->flipDone(ticket);
+        }
+        // Last, a callback may send again.
+        if (buf != nullptr) buf->complete();
+    }
+    return done;
+}
+
+void Rpc::handleSHMResponses() {
+    for (auto p : shm_pendings) {
+        while (p->head != p->tail) {
+            if (p->isDone(p->head)) {
+                p->flipDone(p->head++);
+            } else if (!completeSHM(p, p->head)) {
+                break;
+            }
+            p->stalled = 0;
+        }
+        if (p->head != p->tail && ++p->stalled >= ShmPending::kStallPolls) {
+            p->stalled = 0;
+            uint64_t end = std::min(p->tail, p->head + 64);
+            for (uint64_t t = p->head + 1; t < end; ++t) {
+                if (!p->isDone(t)) completeSHM(p, t);
             }
         }
     }
 }
 
-bool Rpc::tryRecv(MsgBufPair *msg) {
+void Rpc::poll() {
     handleQP();
-    if (shm_ring != nullptr) handleSHMRequests();
-    handleSHMResponses(msg->session);
+    if (shm_ring != nullptr) {
+        handleSHMRequests();
+        handleLocalRequests();
+    }
+    handleRCRequests();
+    handleSHMResponses();
+    handleRCResponses();
+    handleLocalResponses();
+    pumpStreams();
+}
+
+void Rpc::completeResponse(MsgBufPair *buf) {
+    bool by_callback = buf->callback != nullptr;
+    buf->complete();
+    if (!by_callback) return;
+    // A callback that sent again with buf has released it already.
+    if (buf->keep_response) {
+        buf->keep_response = false;
+    } else {
+        releaseResponse(buf);
+    }
+}
+
+bool Rpc::tryRecv(MsgBufPair *msg) {
+    poll();
     if (msg->finished) {
         msg->finished = false;
         return true;
@@ -165,41 +503,68 @@ bool Rpc::tryRecv(MsgBufPair *msg) {
     return false;
 }
 
-void Rpc::recv(MsgBufPair *msg, size_t retry_times) {
+bool Rpc::recv(MsgBufPair *msg, size_t retry_times) {
     DLOG(INFO) << "Receiving for pair " << msg << " " << my_thread_id;
-    for (size_t i = 0; i < retry_times; ++i) {
+    WaitResult waited = kWaitUnhandled;
+    if (wait_hook != nullptr && !msg->finished.load(std::memory_order_acquire)) {
+        waited = wait_hook(msg, retry_times, wait_hook_arg);
+        if (waited == kWaitDone) return true;
+    }
+    for (size_t i = 0; waited == kWaitUnhandled && i < retry_times; ++i) {
         if (msg->finished) {
             DLOG(INFO) << "Finished for pair " << msg << " " << my_thread_id;
             msg->finished = false;
-            return;
+            return true;
         }
-        handleQP();
-        if (shm_ring != nullptr) handleSHMRequests();
-        handleSHMResponses(msg->session);
+        poll();
     }
     LOG(INFO) << "Possible packet loss for rpc id " << (int)msg->send_buf->rpc_hdr.identifier.rpc_id << " sequence "
               << msg->send_buf->rpc_hdr.seq << "... " << my_thread_id << " for msg " << msg << " " << this->ctx->my_ip
               << ":" << this->ctx->my_port << " id " << this->qp.id;
+    return false;
 }
 
 void Rpc::runServerLoopOnce() {
     assert(ctx->is_server);
-    handleQP();
-    handleSHMRequests();
+    int cnt = handleQP();
+    cnt += handleRCRequests();
+    cnt += handleSHMRequests();
+    cnt += handleLocalRequests();
+    pumpStreams();
+    if (cnt > 0 || active_streams > 0) {
+        idle_rounds = 0;
+    } else {
+        idleWait();
+    }
+}
+
+void Rpc::idleWait() {
+    // Workers answer dispatched requests through this loop, don't sleep on them.
+    if (++idle_rounds < kIdleSpinRounds || idle_park_us == 0 || dispatcher != nullptr) {
+        asm volatile("pause" ::: "memory");
+        return;
+    }
+    shm_ring->serverWait(
+        [this]() {
+            int lane_cnt = shm_ring->laneCnt()->load(std::memory_order_acquire);
+            for (int lane = 0; lane < lane_cnt; ++lane) {
+                if (shm_ring->serverTryRecv(lane, shm_tickets_srv[lane])) return true;
+            }
+            int ch_cnt = local_ch_cnt.load(std::memory_order_acquire);
+            for (int i = 0; i < ch_cnt; ++i) {
+                if (!local_chs[i]->reqs.empty()) return true;
+            }
+            return false;
+        },
+        idle_park_us);
 }
 
 // may recursively call.
-void Rpc::handleQP() {
+int Rpc::handleQP() {
+    if (sq_held > 0) pollSendQueue();
     ibv_wc wcs[Context::kQueueDepth];
     int finished = ibv_poll_cq(qp.qp->recv_cq, Context::kQueueDepth, wcs);
-    recv_cnt += finished;
-    if (unlikely(recv_cnt >= Context::kQueueDepth)) {
-        LOG(INFO) << "Recv Queue is exhausted...";
-    }
-    while (recv_cnt >= kRecvWrGroupSize) {
-        postNextGroupRecv();
-        recv_cnt -= kRecvWrGroupSize;
-    }
+    if (finished > 0) TRACE(kTraceQPPoll, finished, 0);
     for (int i = 0; i < finished; ++i) {
         MsgBufPair *cur_pair = (MsgBufPair *)wcs[i].wr_id;
         cur_pair->recv_buf->size = wcs[i].byte_len - kUDHeaderSize - sizeof(RpcHeader);
@@ -211,12 +576,24 @@ void Rpc::handleQP() {
         if (identifier.rpc_id == kRpcResponse) {
             // Client-side response. Fill in the recv_buf.
             auto seq = cur_pair->recv_buf->rpc_hdr.seq;
-            MsgBufPair *pair = seq_buf_map[seq];
-            assert(pair != nullptr);
-            seq_buf_map.erase(seq);
+            MsgBufPair *pair = untrackResponse(seq);
+            if (unlikely(pair == nullptr)) {
+                // Late, the request was cancelled.
+                recv_pool->release(cur_pair);
+                continue;
+            }
+            // Read in place, the buffer goes back to the pool once the client is done with it.
             pair->recv_buf = cur_pair->recv_buf;
+            pair->rx_pool = recv_pool;
+            pair->rx_pair = cur_pair;
             DLOG(INFO) << "Cur pair " << cur_pair << " pair " << pair << " got response " << my_thread_id;
-            pair->finished.store(true, std::memory_order_release);
+            completeResponse(pair);
+        } else if (identifier.rpc_id == kRpcStreamChunk) {
+            onStreamChunk(cur_pair->recv_buf);
+            recv_pool->release(cur_pair);
+        } else if (identifier.rpc_id == kRpcStreamAck) {
+            onStreamAck(cur_pair->recv_buf);
+            recv_pool->release(cur_pair);
         } else {
             // Server-side RPC.
             cur_pair->send_buf->rpc_hdr.seq = cur_pair->recv_buf->rpc_hdr.seq;
@@ -234,62 +611,294 @@ void Rpc::handleQP() {
                 ah = ibv_create_ah(ctx->ctx.pd, &attr);
                 qpn = info.qpn;
                 if (!ah) {
-                    LOG(FATAL) << "Failed to create ah " << strerror(errno);
+                    // The client's connect times out, the server goes on.
+                    LOG(ERROR) << "Failed to create ah " << strerror(errno);
+                    recv_pool->release(cur_pair);
+                    continue;
                 }
                 id_ah_map[identifier] = std::make_pair(ah, qpn);
             } else {
-                ah = id_ah_map[identifier].first;
-                qpn = id_ah_map[identifier].second;
-                assert(ah != nullptr);
+                auto it = id_ah_map.find(identifier);
+                if (unlikely(it == id_ah_map.end())) {
+                    LOG(WARNING) << "Request from unconnected client " << identifier.key() << ", dropped";
+                    recv_pool->release(cur_pair);
+                    continue;
+                }
+                ah = it->second.first;
+                qpn = it->second.second;
             }
 
-            auto handle = ReqHandle{ this, cur_pair, ah, qpn, ReqHandle::kQP };
-            ctx->funcs[identifier.rpc_id](&handle, context);
+            if (unlikely(ctx->streamed[identifier.rpc_id])) {
+                startStream(ReqHandle{ this, cur_pair, ah, qpn, ReqHandle::kQP, identifier.rpc_id });
+                recv_pool->release(cur_pair);
+                continue;
+            }
+
+            // Without a free dispatch pair the request runs inline.
+            if (dispatcher != nullptr && ctx->dispatched[identifier.rpc_id] && !free_dispatch.empty()) {
+                int di = free_dispatch.back();
+                MsgBufPair *dpair = &dispatch_pairs[di];
+                MsgBuf *req = cur_pair->recv_buf;
+                dpair->recv_buf->size = req->size;
+                dpair->recv_buf->rpc_hdr = req->rpc_hdr;
+                memcpy(dpair->recv_buf->buf, req->buf, req->size);
+                dpair->send_buf->rpc_hdr = cur_pair->send_buf->rpc_hdr;
+                ReqHandle *handle = &qp_handles[di];
+                *handle = ReqHandle{ this, dpair, ah, qpn, ReqHandle::kQP, identifier.rpc_id };
+                if (likely(dispatcher->submit(handle))) {
+                    free_dispatch.pop_back();
+                    recv_pool->release(cur_pair);
+                    continue;
+                }
+                LOG(ERROR) << "Dispatch queues are full, run rpc " << (int)identifier.rpc_id << " inline";
+            }
+            auto handle = ReqHandle{ this, cur_pair, ah, qpn, ReqHandle::kQP, identifier.rpc_id };
+            uint64_t staged = staged_pairs;
+            TRACE(kTraceHandlerBegin, identifier.rpc_id, cur_pair->recv_buf->rpc_hdr.seq);
+            ctx->invoke(identifier.rpc_id, &handle, context);
+            TRACE(kTraceHandlerEnd, identifier.rpc_id, cur_pair->recv_buf->rpc_hdr.seq);
+            // A response holds the pair until its send completes.
+            if (staged_pairs == staged) recv_pool->release(cur_pair);
         }
     }
+    if (dispatcher != nullptr) drainDispatched();
+    flushResponses();
+    return finished;
 }
 
-void Rpc::handleSHMRequests() {
-    while (shm_ring->serverTryRecv(shm_ticket)) {
-        ShmRpcRingSlot *slot = shm_ring->get(shm_ticket);
-        auto handle = ReqHandle{ this, &shm_bufs[shm_ticket % kRingElemCnt], nullptr, 0, ReqHandle::kSHM };
-        ctx->funcs[slot->rpc_id](&handle, context);
-        ++shm_ticket;
+int Rpc::handleSHMRequests() {
+    // Round-robin over the client lanes, a lane holds at most n_ requests.
+    int lane_cnt = shm_ring->laneCnt()->load(std::memory_order_acquire);
+    int cnt = 0;
+    for (int lane = 0; lane < lane_cnt; ++lane) {
+        while (shm_ring->serverTryRecv(lane, shm_tickets_srv[lane])) {
+            uint64_t idx = shm_ring->slotIdx(lane, shm_tickets_srv[lane]++);
+            handleSHMRequest(shm_ring->get(idx), idx);
+            ++cnt;
+        }
     }
+    return cnt;
 }
 
-void Rpc::postNextGroupRecv() {
-    DLOG(INFO) << "postNextGroupRecv " << cur_group;
-    ibv_recv_wr *bad_wr;
-    ibv_post_recv(qp.qp, srv_recv_wr_hdrs[cur_group], &bad_wr);
-    cur_group = (cur_group + 1) % kRecvWrGroupCnt;
+void Rpc::handleSHMRequest(ShmRpcRingSlot *slot, uint64_t idx) {
+    MsgBuf *req = shm_ring->serverReqBuf(idx);
+    if (unlikely(req == nullptr)) {
+        LOG(ERROR) << "shm request " << idx << " outside its lane, rejected";
+        shm_ring->serverReject(idx);
+        return;
+    }
+    shm_bufs[idx].recv_buf = req;
+    uint32_t room = 0;
+    MsgBuf *resp = shm_ring->serverRespBuf(idx, &room);
+    if (unlikely(resp == nullptr || room < ShmRpcRing::kMaxMsgSize)) {
+        // The handler can't be trusted to stay within the room, it writes here and serverSend() checks.
+        if (shm_scratch[idx] == nullptr) shm_scratch[idx] = new MsgBuf;
+        resp = shm_scratch[idx];
+    }
+    shm_bufs[idx].send_buf = resp;
+    if (dispatcher != nullptr && ctx->dispatched[slot->rpc_id]) {
+        // Workers respond to shm requests by themselves.
+        ReqHandle *handle = &shm_handles[idx];
+        *handle = ReqHandle{ this, &shm_bufs[idx], nullptr, 0, ReqHandle::kSHM, slot->rpc_id };
+        if (likely(dispatcher->submit(handle))) return;
+        LOG(ERROR) << "Dispatch queues are full, run rpc " << (int)slot->rpc_id << " inline";
+    }
+    auto handle = ReqHandle{ this, &shm_bufs[idx], nullptr, 0, ReqHandle::kSHM, slot->rpc_id };
+    ctx->invoke(slot->rpc_id, &handle, context);
 }
 
-void RpcSession::send(uint8_t rpc_id, MsgBufPair *buf) {
-    rpc->send(this, rpc_id, buf);
+void Rpc::enableDispatch(int n_workers, int numa) {
+    qp_handles = new ReqHandle[recv_pool->buf_cnt];
+    if (posix_memalign((void **)&dispatch_pairs, kCacheLineSize, sizeof(MsgBufPair) * recv_pool->buf_cnt)) {
+        LOG(FATAL) << "Failed to allocate memory for dispatch buffers";
+    }
+    for (int i = recv_pool->buf_cnt - 1; i >= 0; --i) {
+        new (dispatch_pairs + i) MsgBufPair(ctx, true);
+        free_dispatch.push_back(i);
+    }
+    if (shm_ring != nullptr) {
+        shm_handles = new ReqHandle[kRingElemCnt];
+    }
+    for (int i = 0; i < n_workers; ++i) {
+        dispatch_done.push_back(new SPSCQueue<ReqHandle *>(kDispatchQueueSize));
+    }
+    dispatcher = new WorkStealingPool<ReqHandle *>(n_workers, numa, kDispatchQueueSize, [](ReqHandle *handle, int w) {
+        handle->worker = w;
+        handle->rpc->ctx->invoke(handle->rpc_id, handle, handle->rpc->context);
+    });
+}
+
+void Rpc::drainDispatched() {
+    ReqHandle *handle;
+    for (auto q : dispatch_done) {
+        while (q->pop(handle)) {
+            stageSend(handle->buf->send_buf, handle->ah, handle->src_qp, nullptr, handle->buf);
+        }
+    }
+}
+
+void Rpc::releaseServerPair(MsgBufPair *pair) {
+    if (pair >= recv_pool->bufs && pair < recv_pool->bufs + recv_pool->buf_cnt) {
+        recv_pool->release(pair);
+    } else if (pair >= dispatch_pairs && pair < dispatch_pairs + recv_pool->buf_cnt) {
+        free_dispatch.push_back(pair - dispatch_pairs);
+    }
+}
+
+void Rpc::reserveSendQueue(int n) {
+    // Every run of kRecvWrGroupSize WRs ends with a signaled one, so a completion is always pending here.
+    while (sq_inflight + n > Context::kQueueDepth) {
+        pollSendQueue();
+    }
+}
+
+void Rpc::pollSendQueue() {
+    ibv_wc wcs[Context::kQueueDepth];
+    int finished = ibv_poll_cq(qp.qp->send_cq, Context::kQueueDepth, wcs);
+    for (int i = 0; i < finished; ++i) {
+        if (unlikely(wcs[i].status != IBV_WC_SUCCESS)) {
+            LOG(ERROR) << "Send CQ completion with error: " << wcs[i].status << " ("
+                       << ibv_wc_status_str(wcs[i].status) << ")";
+        }
+        // Completions come in post order, this one retires wr_id WRs from sq_head.
+        for (uint64_t k = 0; k < wcs[i].wr_id; ++k) {
+            MsgBufPair *&owner = sq_pairs[sq_head];
+            if (owner != nullptr) {
+                releaseServerPair(owner);
+                owner = nullptr;
+                --sq_held;
+            }
+            sq_head = (sq_head + 1) % Context::kQueueDepth;
+        }
+        sq_inflight -= wcs[i].wr_id;
+    }
+}
+
+void Rpc::flushResponses() {
+    if (resp_cnt == 0) return;
+    // One doorbell for the whole chain, signal its tail only when the unsignaled run gets long.
+    reserveSendQueue(resp_cnt);
+    ibv_send_wr *tail = &resp_wrs[resp_cnt - 1];
+    tail->next = nullptr;
+    for (int i = 0; i < resp_cnt; ++i) {
+        sq_pairs[(sq_head + sq_inflight + i) % Context::kQueueDepth] = resp_owners[i];
+    }
+    sq_inflight += resp_cnt;
+    sq_unsignaled += resp_cnt;
+    sq_held += resp_held;
+    // Owned buffers go back on the completion, signal at once so that an idle server doesn't keep them.
+    if (resp_held > 0 || sq_unsignaled >= Rpc::kRecvWrGroupSize) {
+        tail->send_flags = IBV_SEND_SIGNALED;
+        tail->wr_id = sq_unsignaled;
+        sq_unsignaled = 0;
+    }
+    ibv_send_wr *bad_wr;
+    int ret = ibv_post_send(qp.qp, resp_wrs, &bad_wr);
+    if (unlikely(ret)) {
+        LOG(ERROR) << "Post response chain failed " << strerror(ret);
+    }
+    resp_cnt = 0;
+    resp_held = 0;
+}
+
+RpcEndpoint::RpcEndpoint(RpcContext *rpc_ctx, void *context, int ep_qp_id, int n_workers, int numa,
+                         bool shared_recv, int dispatch_workers)
+    : ctx(rpc_ctx), ep_qp_id(ep_qp_id), n_workers(n_workers), rpcs(n_workers, nullptr) {
+    running.store(true, std::memory_order_release);
+    for (int i = 0; i < n_workers; ++i) {
+        workers.emplace_back([this, context, numa, shared_recv, dispatch_workers, i]() {
+            // Rpc buffers are allocated by the worker, so they are NUMA-local.
+            numa_run_on_node(numa);
+            // A shared pool keeps kSrvBufCnt buffers per worker, in groups of the usual size.
+            int bufs = shared_recv ? Rpc::kSrvBufCnt * this->n_workers : Rpc::kSrvBufCnt;
+            int groups = shared_recv ? Rpc::kRecvWrGroupCnt * this->n_workers : Rpc::kRecvWrGroupCnt;
+            Rpc *rpc = new Rpc(ctx, context, this->ep_qp_id + i, bufs, groups, shared_recv);
+            if (dispatch_workers > 0) rpc->enableDispatch(dispatch_workers, numa);
+            rpcs[i] = rpc;
+            ready.fetch_add(1, std::memory_order_acq_rel);
+            while (running.load(std::memory_order_acquire)) {
+                rpc->runServerLoopOnce();
+            }
+        });
+    }
+    while (ready.load(std::memory_order_acquire) != n_workers) {}
+    // Publish only when every worker QP is ready.
+    ctx->ctx.mgr->put(ep_key(ep_qp_id), std::to_string(n_workers));
+    LOG(INFO) << ctx->my_ip << ":" << ctx->my_port << " endpoint " << ep_qp_id << " with " << n_workers
+              << " workers";
+}
+
+RpcEndpoint::~RpcEndpoint() {
+    stop();
+}
+
+void RpcEndpoint::stop() {
+    running.store(false, std::memory_order_release);
+    for (auto &t : workers) {
+        if (t.joinable()) t.join();
+    }
+}
+
+bool RpcSession::send(uint8_t rpc_id, MsgBufPair *buf) {
+    return rpc->send(this, rpc_id, buf);
 }
 
-void RpcSession::recv(MsgBufPair *msg, size_t retry_times) {
-    rpc->recv(msg, retry_times);
+bool RpcSession::recv(MsgBufPair *msg, size_t retry_times) {
+    return rpc->recv(msg, retry_times);
+}
+
+void Rpc::stageSend(MsgBuf *sbuf, ibv_ah *ah, uint32_t qpn, MsgBuf *payload, MsgBufPair *owner) {
+    // Staged, posted by flushResponses() at the end of the loop iteration.
+    if (unlikely(resp_cnt == kMaxRespBatch)) {
+        flushResponses();
+    }
+    int i = resp_cnt++;
+    resp_owners[i] = owner;
+    if (owner != nullptr) {
+        ++resp_held;
+        ++staged_pairs;
+    }
+    ibv_sge *sges = resp_sges[i];
+    sges[0].addr = (uint64_t)&sbuf->rpc_hdr;
+    sges[0].length = (payload == nullptr ? sbuf->size : 0) + sizeof(RpcHeader);
+    sges[0].lkey = sbuf->lkey;
+    if (payload != nullptr) {
+        sges[1].addr = (uint64_t)payload->buf;
+        sges[1].length = payload->size;
+        sges[1].lkey = payload->lkey;
+    }
+    ibv_send_wr &wr = resp_wrs[i];
+    wr.wr_id = 0;
+    wr.next = &resp_wrs[i + 1];
+    wr.sg_list = sges;
+    wr.num_sge = payload == nullptr ? 1 : 2;
+    wr.opcode = IBV_WR_SEND;
+    wr.send_flags = 0;
+    wr.wr.ud.ah = ah;
+    wr.wr.ud.remote_qpn = qpn;
+    wr.wr.ud.remote_qkey = kUDQkey;
 }
 
 void ReqHandle::response() {
+    TRACE(kTraceResponse, type, rpc_id);
     if (type == kQP) {
-        auto &sbuf = buf->send_buf;
-        DLOG(INFO) << "Response " << buf << " with sequence " << sbuf->rpc_hdr.seq;
-        // sync -> batch, 800K -> 4M (reduce poll cq race)
-        if (++rpc->send_cnt >= Rpc::kRecvWrGroupSize) {
-            rpc->qp.send((uint64_t)&sbuf->rpc_hdr, sbuf->size + sizeof(RpcHeader), sbuf->lkey, ah, src_qp,
-                         IBV_SEND_SIGNALED);
-            ibv_wc wc;
-            rpc->qp.pollSendCQ(1, &wc);
-            rpc->send_cnt = 0;
-        } else {
-            rpc->qp.send((uint64_t)&sbuf->rpc_hdr, sbuf->size + sizeof(RpcHeader), sbuf->lkey, ah, src_qp, 0);
+        DLOG(INFO) << "Response " << buf << " with sequence " << buf->send_buf->rpc_hdr.seq;
+        if (worker >= 0) {
+            // Back to the poller, which owns the QP.
+            while (unlikely(!rpc->dispatch_done[worker]->push(this))) {}
+            return;
         }
+        rpc->stageSend(buf->send_buf, ah, src_qp, nullptr, buf);
+    } else if (type == kRC) {
+        rpc->postRCResponse(rc_qp, buf->send_buf);
+    } else if (type == kRing) {
+        rpc->postRingResponse(ring, buf);
+    } else if (type == kLocal) {
+        std::swap(buf->send_buf, buf->recv_buf);
+        local->done[buf->ticket % LocalChannel::kDepth].store(true, std::memory_order_release);
     } else {
         assert(type == kSHM);
-        rpc->shm_ring->serverSend(this->buf->ticket);
+        rpc->shm_ring->serverSend(this->buf->ticket, this->buf->send_buf);
     }
 }
 
@@ -0,0 +1,235 @@
+#include "rdma/rpc.h"
+
+#include "utils/defs.h"
+
+// Streaming RPC, see rdma/rpc/stream.h.
+
+namespace rdma {
+
+RpcStream::RpcStream(RpcContext *rpc_ctx) : ack(rpc_ctx) {}
+
+MsgBuf *RpcStream::next(size_t retry_times) {
+    if (delivering) {
+        // The caller is done with the previous chunk.
+        present[next_idx % kStreamWindow] = false;
+        ++next_idx;
+        delivering = false;
+        if (next_idx - acked >= kStreamWindow / 2 && !done()) {
+            acked = next_idx;
+            rpc->sendStreamAck(this, acked);
+        }
+    }
+    if (done()) return nullptr;
+
+    uint32_t slot = next_idx % kStreamWindow;
+    for (size_t i = 0; i < retry_times; ++i) {
+        if (present[slot]) {
+            delivering = true;
+            return &chunks[slot];
+        }
+        rpc->poll();
+    }
+    return nullptr;
+}
+
+void RpcStream::onChunk(MsgBuf *rbuf) {
+    uint32_t idx = rbuf->rpc_hdr.identifier.ctx_id;
+    if (idx < next_idx + delivering || idx >= next_idx + kStreamWindow) {
+        LOG(ERROR) << "Stream " << seq << " got chunk " << idx << " out of window " << next_idx;
+        return;
+    }
+    // Copied out, so the receive buffer goes back to its pool right away.
+    MsgBuf &chunk = chunks[idx % kStreamWindow];
+    chunk.size = rbuf->size;
+    chunk.rpc_hdr = rbuf->rpc_hdr;
+    memcpy(chunk.buf, rbuf->buf, rbuf->size);
+    present[idx % kStreamWindow] = true;
+    if (rbuf->rpc_hdr.identifier.qp_id & kStreamLast) {
+        last_idx = idx;
+    }
+}
+
+ServerStream::ServerStream(RpcContext *rpc_ctx) : handle(new ReqHandle), pair(rpc_ctx, true) {
+    for (int i = 0; i < kStreamWindow; ++i) {
+        chunk_bufs[i] = rpc_ctx->allocBuf();
+    }
+    end_buf = rpc_ctx->allocBuf();
+}
+
+RpcStream *Rpc::openStream(RpcSession *session, uint8_t rpc_id, MsgBufPair *buf) {
+    if (session->transport != RpcTransport::kUD && session->transport != RpcTransport::kRC) {
+        LOG(ERROR) << "Streams need a UD or RC session";
+        return nullptr;
+    }
+    RpcStream *stream;
+    if (free_streams.empty()) {
+        stream = new RpcStream(ctx);
+    } else {
+        stream = free_streams.back();
+        free_streams.pop_back();
+    }
+    stream->rpc = this;
+    stream->session = session;
+    stream->req = buf;
+    memset(stream->present, 0, sizeof(stream->present));
+    stream->next_idx = 0;
+    stream->last_idx = UINT32_MAX;
+    stream->acked = 0;
+    stream->delivering = false;
+    buf->stream = stream;
+
+    if (session->transport == RpcTransport::kRC) {
+        // The chunks land in the session's receives, hold credits for a full window and the final chunk of a cancel.
+        // The request takes one more in sendRC.
+        while (session->qp->credits < kStreamWindow + 1) {
+            handleRCResponses();
+        }
+        session->qp->credits -= kStreamWindow;
+    }
+    send(session, rpc_id, buf);
+    stream->seq = buf->send_buf->rpc_hdr.seq;
+    return stream;
+}
+
+void Rpc::closeStream(RpcStream *stream) {
+    if (!stream->done()) {
+        // Cancel, the server drops the stream.
+        sendStreamAck(stream, UINT32_MAX);
+    }
+    if (seq_bufs[stream->seq & (kMaxInflight - 1)] == stream->req) {
+        untrackSeq(stream->seq);
+    }
+    if (stream->session->transport == RpcTransport::kRC) {
+        if (stream->last_idx != UINT32_MAX) {
+            // Every chunk is in.
+            stream->session->qp->credits += kStreamWindow + 1;
+        } else {
+            closing_streams.emplace_back(stream->seq, stream->session->qp);
+        }
+    }
+    stream->req->stream = nullptr;
+    free_streams.push_back(stream);
+}
+
+void Rpc::sendStreamAck(RpcStream *stream, uint32_t consumed) {
+    // Acks are cumulative, so the buffer can be rewritten while a previous ack is in flight.
+    RpcSession *session = stream->session;
+    MsgBuf *sbuf = stream->ack.send_buf;
+    sbuf->rpc_hdr.identifier = RpcIdentifier(identifier, kRpcStreamAck);
+    sbuf->rpc_hdr.seq = stream->seq;
+    *(uint32_t *)sbuf->buf = consumed;
+    sbuf->size = sizeof(uint32_t);
+    if (session->transport == RpcTransport::kUD) {
+        stageSend(sbuf, session->ah, session->destQPN(stream->seq));
+        flushResponses();
+    } else {
+        int flags = reserveRC(session->qp);
+        session->qp->qp->send((uint64_t)&sbuf->rpc_hdr, sbuf->size + sizeof(RpcHeader), sbuf->lkey, flags, false, 0,
+                              (uint64_t)session->qp);
+    }
+}
+
+void Rpc::onStreamChunk(MsgBuf *rbuf) {
+    MsgBufPair *pair = seq_bufs[rbuf->rpc_hdr.seq & (kMaxInflight - 1)];
+    if (pair == nullptr || pair->stream == nullptr || pair->stream->seq != rbuf->rpc_hdr.seq) {
+        // Closed stream, the credits of a cancelled one come back with its final chunk.
+        if (!(rbuf->rpc_hdr.identifier.qp_id & kStreamLast)) return;
+        for (auto it = closing_streams.begin(); it != closing_streams.end(); ++it) {
+            if (it->first == rbuf->rpc_hdr.seq) {
+                it->second->credits += kStreamWindow + 1;
+                closing_streams.erase(it);
+                return;
+            }
+        }
+        return;
+    }
+    pair->stream->onChunk(rbuf);
+}
+
+void Rpc::startStream(const ReqHandle &handle) {
+    ServerStream *st = nullptr;
+    for (auto s : srv_streams) {
+        if (!s->active) {
+            st = s;
+            break;
+        }
+    }
+    if (st == nullptr) {
+        st = new ServerStream(ctx);
+        srv_streams.push_back(st);
+    }
+    // The request outlives its receive buffer.
+    MsgBuf *req = handle.buf->recv_buf;
+    MsgBuf *copy = st->pair.recv_buf;
+    copy->size = req->size;
+    copy->rpc_hdr = req->rpc_hdr;
+    memcpy(copy->buf, req->buf, req->size);
+    *st->handle = handle;
+    st->handle->buf = &st->pair;
+    st->client = req->rpc_hdr.identifier;
+    st->seq = req->rpc_hdr.seq;
+    st->next = 0;
+    st->acked = 0;
+    st->active = true;
+    ++active_streams;
+}
+
+void Rpc::onStreamAck(MsgBuf *rbuf) {
+    uint32_t consumed = *(uint32_t *)rbuf->buf;
+    for (auto st : srv_streams) {
+        if (st->active && st->seq == rbuf->rpc_hdr.seq && st->client == rbuf->rpc_hdr.identifier) {
+            if (consumed == UINT32_MAX) {
+                st->active = false;
+                --active_streams;
+                if (st->handle->type != ReqHandle::kQP) {
+                    // After the chunks already posted on the QP, it tells the client they are all in.
+                    MsgBuf *end = st->end_buf;
+                    end->size = 0;
+                    end->rpc_hdr.identifier.ctx_id = st->next;
+                    end->rpc_hdr.identifier.qp_id = kStreamLast;
+                    end->rpc_hdr.identifier.rpc_id = kRpcStreamChunk;
+                    end->rpc_hdr.seq = st->seq;
+                    postRCResponse(st->handle->rc_qp, end);
+                }
+            } else {
+                st->acked = std::max(st->acked, consumed);
+            }
+            return;
+        }
+    }
+}
+
+void Rpc::pumpStreams() {
+    if (active_streams == 0) return;
+    for (auto st : srv_streams) {
+        if (!st->active) continue;
+        ReqHandle *handle = st->handle;
+        // Chunk next - kStreamWindow, whose buffer is reused, has been consumed.
+        while (st->next < st->acked + kStreamWindow) {
+            MsgBuf *chunk = st->chunk_bufs[st->next % kStreamWindow];
+            st->pair.send_buf = chunk;
+            bool more = ctx->stream_funcs[handle->rpc_id](handle, context);
+
+            RpcIdentifier id;
+            id.ctx_id = st->next;
+            id.qp_id = more ? 0 : kStreamLast;
+            id.rpc_id = kRpcStreamChunk;
+            chunk->rpc_hdr.identifier = id;
+            chunk->rpc_hdr.seq = st->seq;
+            if (handle->type == ReqHandle::kQP) {
+                stageSend(chunk, handle->ah, handle->src_qp);
+            } else {
+                postRCResponse(handle->rc_qp, chunk);
+            }
+            ++st->next;
+            if (!more) {
+                st->active = false;
+                --active_streams;
+                break;
+            }
+        }
+    }
+    flushResponses();
+}
+
+}  // namespace rdma
@@ -18,6 +18,7 @@ int main() {
         Rpc rpc(&client_ctx, nullptr, 0);
         RpcSession session = rpc.connect(server_ip, server_port, 0);
         MsgBufPair *buf[64];
+        RpcFuture futures[64];
         for (int i = 0; i < 64; ++i) {
             buf[i] = new MsgBufPair(&client_ctx);
         }
@@ -27,10 +28,10 @@ int main() {
                 buf[i]->send_buf->size = sizeof(uint64_t);
             }
             for (int i = 0; i < 64; ++i) {
-                rpc.send(&session, 6, buf[i]);
+                futures[i] = rpc.sendAsync(&session, 6, buf[i]);
             }
+            whenAll(futures, 64);
             for (int i = 0; i < 64; ++i) {
-                rpc.recv(buf[i]);
                 if (*(uint64_t *)buf[i]->recv_buf->buf != i) {
                     LOG(ERROR) << "Error: " << *(uint64_t *)buf[i]->recv_buf->buf;
                 }
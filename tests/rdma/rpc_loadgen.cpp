@@ -0,0 +1,239 @@
+#include <bits/stdc++.h>
+
+#include "stdrdma.h"
+#include "stdutils.h"
+
+using namespace rdma;
+using namespace std;
+
+// Open-loop load generator: every client thread issues requests on a fixed or Poisson schedule, whatever the
+// responses do, and the latency of a request is measured from its scheduled time, so queueing shows up.
+// The offered rate goes up by step_rate every step until the server saturates (achieved < 90% of offered) or
+// max_rate, and the latency-throughput curve is written as CSV, or JSON when the output ends with .json.
+// A UD request without a response after kLossTimeoutMs is counted as lost and its buffer reused.
+//
+// rpc_loadgen is_server client_threads server_threads clt_numa srv_numa transport
+//             [start_rate step_rate max_rate step_seconds poisson output]
+
+constexpr char kClientIP[] = "10.0.2.172";
+constexpr char kServerIP[] = "10.0.2.172";
+constexpr int kMaxInflight = 256;  // per thread, later requests wait for a free buffer.
+constexpr int kMaxThreads = 256;
+constexpr double kSaturation = 0.9;
+constexpr uint64_t kLossTimeoutMs = 100;
+constexpr uint64_t kReapIntervalNs = 1000000;
+
+struct Row {
+    double offered, achieved, p50, p99, p999, max;
+    uint64_t cnt, lost;
+};
+
+struct alignas(::hardware_destructive_interference_size) StepStat {
+    LatencyHist hist;
+    uint64_t completed;
+    uint64_t lost;
+};
+
+int client_threads = 1, server_threads = 1, clt_numa = 2, srv_numa = 0;
+RpcTransport transport = RpcTransport::kUD;
+double start_rate = 100000, step_rate = 100000, max_rate = 10000000, step_seconds = 5;
+bool poisson = true;
+string output;
+
+StepStat stats[kMaxThreads];
+atomic<int> next_tid{ 0 };
+atomic<int> done_cnt{ 0 };
+atomic<int> decided{ -1 };
+atomic<bool> stop_sweep{ false };
+
+struct Slot {
+    MsgBufPair *buf;
+    uint64_t sched;
+    struct LoadThread *th;
+    uint64_t sent = 0;
+    bool inflight = false;
+};
+
+struct LoadThread {
+    vector<Slot *> slots;
+    vector<Slot *> free_slots;
+    LatencyHist hist;
+    uint64_t completed = 0;
+    uint64_t lost = 0;
+};
+
+void onResponse(MsgBufPair *, void *arg) {
+    Slot *slot = (Slot *)arg;
+    slot->th->hist.record(TscClock::nowNs() - slot->sched);
+    ++slot->th->completed;
+    slot->inflight = false;
+    slot->th->free_slots.push_back(slot);
+}
+
+// UD drops requests under overload, their slots would never come back. Those sent before deadline are given up.
+void reapLost(Rpc &rpc, LoadThread &th, uint64_t deadline) {
+    for (Slot *slot : th.slots) {
+        if (!slot->inflight || slot->sent >= deadline) continue;
+        rpc.cancel(slot->buf);
+        slot->inflight = false;
+        ++th.lost;
+        th.free_slots.push_back(slot);
+    }
+}
+
+void clientLoop() {
+    int tid = next_tid.fetch_add(1);
+    RpcContext client_ctx(kClientIP, 10000 + tid, 1 + tid, 0, 0, -1);
+    Rpc rpc(&client_ctx, nullptr, 0);
+    RpcSession session = transport == RpcTransport::kUD
+                             ? rpc.connectEndpoint(kServerIP, 20000, 0)
+                             : rpc.connect(kServerIP, 20000, tid % server_threads, transport, 64);
+    LoadThread th;
+    for (int i = 0; i < kMaxInflight; ++i) {
+        th.slots.push_back(new Slot{ new MsgBufPair(&client_ctx), 0, &th });
+    }
+    th.free_slots = th.slots;
+    bool lossy = transport == RpcTransport::kUD;
+    mt19937_64 rng(tid + 1);
+
+    for (int step = 0;; ++step) {
+        double rate = (start_rate + step * step_rate) / client_threads;  // per thread, req/s.
+        exponential_distribution<double> exp_gap(rate / 1e9);
+        auto gap = [&]() { return poisson ? exp_gap(rng) : 1e9 / rate; };
+        deque<uint64_t> due;  // scheduled, waiting for a buffer.
+        uint64_t begin = TscClock::nowNs(), end = begin + step_seconds * 1e9;
+        double next = begin;
+        uint64_t next_reap = begin + kReapIntervalNs;
+        th.hist.reset();
+        th.completed = 0;
+        th.lost = 0;
+        for (uint64_t now = begin; now < end; now = TscClock::nowNs()) {
+            if (lossy && now >= next_reap) {
+                reapLost(rpc, th, now - kLossTimeoutMs * 1000000);
+                next_reap = now + kReapIntervalNs;
+            }
+            while (next <= now) {
+                due.push_back(next);
+                next += gap();
+            }
+            while (!due.empty() && !th.free_slots.empty()) {
+                Slot *slot = th.free_slots.back();
+                th.free_slots.pop_back();
+                slot->sched = due.front();
+                due.pop_front();
+                slot->buf->send_buf->size = 64;
+                slot->sent = now;
+                slot->inflight = true;
+                rpc.sendAsync(&session, 6, slot->buf, onResponse, slot);
+            }
+            rpc.poll();
+        }
+        // Requests still due were never sent, they count as lost throughput. Let the sent ones land, for their
+        // latency only: the throughput is what completed within the step.
+        uint64_t in_step = th.completed;
+        uint64_t drain_end = TscClock::nowNs() + 1000000000ull;
+        while (th.free_slots.size() < kMaxInflight && TscClock::nowNs() < drain_end) {
+            rpc.poll();
+        }
+        if (lossy) reapLost(rpc, th, UINT64_MAX);
+        stats[tid].hist = th.hist;
+        stats[tid].completed = in_step;
+        stats[tid].lost = th.lost;
+        done_cnt.fetch_add(1);
+        while (decided.load() < step) {
+            rpc.poll();
+        }
+        if (stop_sweep.load()) break;
+    }
+}
+
+void report(const vector<Row> &rows) {
+    ostringstream os;
+    bool json = output.size() > 5 && output.substr(output.size() - 5) == ".json";
+    if (json) {
+        os << "[\n";
+        for (size_t i = 0; i < rows.size(); ++i) {
+            auto &r = rows[i];
+            os << "  {\"offered_rps\": " << r.offered << ", \"achieved_rps\": " << r.achieved
+               << ", \"p50_us\": " << r.p50 << ", \"p99_us\": " << r.p99 << ", \"p999_us\": " << r.p999
+               << ", \"max_us\": " << r.max << ", \"count\": " << r.cnt << ", \"lost\": " << r.lost << "}"
+               << (i + 1 < rows.size() ? "," : "") << "\n";
+        }
+        os << "]\n";
+    } else {
+        os << "offered_rps,achieved_rps,p50_us,p99_us,p999_us,max_us,count,lost\n";
+        for (auto &r : rows) {
+            os << r.offered << "," << r.achieved << "," << r.p50 << "," << r.p99 << "," << r.p999 << "," << r.max
+               << "," << r.cnt << "," << r.lost << "\n";
+        }
+    }
+    cout << os.str();
+    if (!output.empty()) {
+        ofstream(output) << os.str();
+    }
+}
+
+int main(int argc, char **argv) {
+    TscClock::calibrate();
+    int is_server = false;
+    if (argc > 6) {
+        is_server = atoi(argv[1]);
+        client_threads = atoi(argv[2]);
+        server_threads = atoi(argv[3]);
+        clt_numa = atoi(argv[4]);
+        srv_numa = atoi(argv[5]);
+        transport = (RpcTransport)atoi(argv[6]);
+    }
+    if (argc > 12) {
+        start_rate = atof(argv[7]);
+        step_rate = atof(argv[8]);
+        max_rate = atof(argv[9]);
+        step_seconds = atof(argv[10]);
+        poisson = atoi(argv[11]);
+        output = argv[12];
+    }
+    if (is_server) {
+        RpcContext server_ctx(kServerIP, 20000, 0, srv_numa, 0, -1);
+        server_ctx.regFunc(6, [](ReqHandle *req, void *) {
+            req->buf->send_buf->size = req->buf->recv_buf->size;
+            req->response();
+        });
+        RpcEndpoint endpoint(&server_ctx, nullptr, 0, server_threads, srv_numa);
+        LOG(INFO) << "Polling...";
+        while (true) sleep(1);
+    }
+
+    auto loop = clientLoop;
+    vector<Thread> threads(client_threads);
+    for (int i = 0; i < client_threads; ++i) {
+        threads[i] = Thread(clt_numa, loop);
+    }
+    vector<Row> rows;
+    for (int step = 0;; ++step) {
+        while (done_cnt.load() < client_threads * (step + 1)) {
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+        LatencyHist hist;
+        uint64_t completed = 0, lost = 0;
+        for (int i = 0; i < client_threads; ++i) {
+            hist.merge(stats[i].hist);
+            completed += stats[i].completed;
+            lost += stats[i].lost;
+        }
+        Row r{ start_rate + step * step_rate, completed / step_seconds, hist.percentile(50) / 1e3,
+               hist.percentile(99) / 1e3, hist.percentile(99.9) / 1e3, hist.max / 1e3, hist.cnt, lost };
+        rows.push_back(r);
+        LOG(INFO) << "offered " << r.offered << " achieved " << r.achieved << " p50 " << r.p50 << "us p99 " << r.p99
+                  << "us p99.9 " << r.p999 << "us lost " << r.lost;
+        bool saturated = r.achieved < kSaturation * r.offered;
+        if (saturated || r.offered + step_rate > max_rate) {
+            stop_sweep.store(true);
+        }
+        decided.store(step);
+        if (stop_sweep.load()) break;
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    report(rows);
+}
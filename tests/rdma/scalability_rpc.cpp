@@ -15,9 +15,14 @@ int kClientThreads = 0;
 int kServerThreads = 0;
 int clt_numa = 2;
 int srv_numa = 0;
+// 0 auto, 1 UD, 2 RC, 3 write ring.
+RpcTransport transport = RpcTransport::kUD;
+double warmup_s = 2, duration_s = 10;
 TotalOp total_op[512];
+LatencyHist hists[512];
 
 int main(int argc, char **argv) {
+    TscClock::calibrate();
     int is_server = false;
     if (argc > 1) {
         is_server = atoi(argv[1]);
@@ -26,48 +31,55 @@ int main(int argc, char **argv) {
         clt_numa = atoi(argv[4]);
         srv_numa = atoi(argv[5]);
     }
+    if (argc > 6) {
+        transport = (RpcTransport)atoi(argv[6]);
+    }
+    if (argc > 8) {
+        warmup_s = atof(argv[7]);
+        duration_s = atof(argv[8]);
+    }
     if (!is_server) {
         Benchmark bm = Benchmark::run((Benchmark::BindCoreStrategy)clt_numa, kClientThreads, total_op, [&]() {
             RpcContext client_ctx(kClientIP, 10000 + my_thread_id, 1 + my_thread_id, 0, 0, -1);
             Rpc rpc(&client_ctx, nullptr, 0);
-            LOG(INFO) << "Connect to " << kServerIP << ":" << 20000 + (my_thread_id % kServerThreads);
-            RpcSession session = rpc.connect(kServerIP, 20000 + (my_thread_id % kServerThreads), 0);
+            RpcSession session;
+            if (transport == RpcTransport::kUD) {
+                LOG(INFO) << "Connect to endpoint " << kServerIP << ":" << 20000;
+                session = rpc.connectEndpoint(kServerIP, 20000, 0);
+            } else {
+                // One connection to a single worker.
+                LOG(INFO) << "Connect to " << kServerIP << ":" << 20000 << " worker " << my_thread_id % kServerThreads;
+                session = rpc.connect(kServerIP, 20000, my_thread_id % kServerThreads, transport, 64);
+            }
             LOG(INFO) << "Connect finished";
             MsgBufPair *buf[32];
             for (int i = 0; i < 32; ++i) {
                 buf[i] = new MsgBufPair(&client_ctx);
             }
-            uint64_t cur = 0;
-            while (true) {
+            uint64_t sent[32];
+            while (Benchmark::running()) {
                 for (int i = 0; i < 32; ++i) {
                     buf[i]->send_buf->size = 64;
+                    sent[i] = TscClock::nowNs();
                     rpc.send(&session, 6, buf[i]);
                 }
                 for (int i = 0; i < 32; ++i) {
                     rpc.recv(buf[i]);
+                    if (Benchmark::measuring()) hists[my_thread_id].record(TscClock::nowNs() - sent[i]);
                 }
                 total_op[my_thread_id].ops += 32;
             }
         });
-        bm.printTputAndJoin();
+        bm.measure(warmup_s, duration_s, hists);
     } else {
-        Thread t[kServerThreads];
-        for (int i = 0; i < kServerThreads; ++i) {
-            t[i] = Thread(srv_numa, [&]() {
-                LOG(INFO) << "Server context created with " << kServerIP << ":" << 20000 + my_thread_id;
-                RpcContext server_ctx(kServerIP, 20000 + my_thread_id, 0, 0, 0, -1);
-                server_ctx.regFunc(6, [](ReqHandle *req, void *context) {
-                    // memcpy(req->buf->send_buf->buf, req->buf->recv_buf->buf, req->buf->recv_buf->size);
-                    req->buf->send_buf->size = req->buf->recv_buf->size;
-                    req->response();
-                });
-                Rpc server_rpc(&server_ctx, nullptr, 0);
-                LOG(INFO) << "Polling...";
-                while (true) {
-                    server_rpc.runServerLoopOnce();
-                }
-            });
-        }
+        // One endpoint, kServerThreads workers.
+        RpcContext server_ctx(kServerIP, 20000, 0, srv_numa, 0, -1);
+        server_ctx.regFunc(6, [](ReqHandle *req, void *) {
+            req->buf->send_buf->size = req->buf->recv_buf->size;
+            req->response();
+        });
+        RpcEndpoint endpoint(&server_ctx, nullptr, 0, kServerThreads, srv_numa);
+        LOG(INFO) << "Polling...";
         while (true) sleep(1);
     }
 }
\ No newline at end of file
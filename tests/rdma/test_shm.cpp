@@ -7,27 +7,46 @@
 using namespace rdma;
 
 constexpr int kThreads = 1;
+constexpr int kSlots = ShmRpcRing::kMaxLanes * 32;
+constexpr uint64_t kArenaSize = ShmRpcRing::kMaxLanes * 64 * 1024;
 
 int main(int argc, char **argv) {
+    // test_shm [zero_copy]
+    bool zero_copy = argc > 1 && atoi(argv[1]) != 0;
     Thread t(0, []() {
-        ShmRpcRing *ring = ShmRpcRing::create("123", 32);
-        uint64_t ticket = 0;
+        ShmRpcRing *ring = ShmRpcRing::create("123", kSlots, kArenaSize);
+        uint64_t tickets[kThreads]{};
         while (true) {
-            ring->serverRecv(ticket);
-            memcpy(ring->get(ticket)->send_buf.buf, ring->get(ticket)->recv_buf.buf, ring->get(ticket)->recv_buf_size);
-            ring->serverSend(ticket);
-            ++ticket;
+            for (int lane = 0; lane < kThreads; ++lane) {
+                if (!ring->serverTryRecv(lane, tickets[lane])) continue;
+                ShmRpcRingSlot *slot = ring->get(lane, tickets[lane]);
+                MsgBuf *resp = ring->respBuf(slot);
+                memcpy(resp->buf, ring->reqBuf(slot)->buf, slot->req_size);
+                resp->size = slot->req_size;
+                ring->serverSend(ring->slotIdx(lane, tickets[lane]++), resp);
+            }
         }
     });
     sleep(1);
     TotalOp total_op[kThreads];
     Benchmark::run(Benchmark::kNUMA0, kThreads, total_op, [&]() {
-        ShmRpcRing *ring = ShmRpcRing::open("123", 32);
+        ShmRpcRing *ring = ShmRpcRing::open("123", kSlots, kArenaSize);
+        int lane = ring->registerLane();
         MsgBuf buf;
         buf.size = 64;
+        while (zero_copy) {
+            uint64_t cur;
+            ShmRpcRingSlot *slot;
+            while ((slot = ring->clientTryReserve(lane, buf.size, buf.size, &cur)) == nullptr) {}
+            ring->reqBuf(slot)->size = buf.size;
+            ring->clientCommit(slot, 1);
+            while (!ring->clientTryPoll(slot)) {}
+            ring->clientRelease(lane, slot);
+            total_op[my_thread_id - 1].ops++;
+        }
         while (true) {
-            uint64_t cur = ring->clientSend(1, &buf);
-            ring->clientRecv(&buf, cur);
+            uint64_t cur = ring->clientSend(lane, 1, &buf, buf.size);
+            ring->clientRecv(lane, &buf, cur);
             total_op[my_thread_id - 1].ops++;
         }
     }).printTputAndJoin();
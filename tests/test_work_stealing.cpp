@@ -0,0 +1,100 @@
+#include <bits/stdc++.h>
+
+#include "stdutils.h"
+
+using namespace std;
+
+// Concurrency check of utils/work_stealing.h: every task is taken exactly once, and each consumer of an
+// SPMCQueue sees its tasks in push order.
+//
+// test_work_stealing [consumers] [tasks]
+
+int consumers = 4;
+uint64_t tasks = 1000000;
+
+bool testQueue() {
+    SPMCQueue<uint64_t> queue(1024);
+    vector<atomic<uint8_t>> seen(tasks);
+    atomic<bool> done{ false };
+    atomic<uint64_t> out_of_order{ 0 };
+    vector<thread> threads;
+    for (int c = 0; c < consumers; ++c) {
+        threads.emplace_back([&]() {
+            uint64_t prev = 0, t;
+            bool first = true;
+            while (true) {
+                // Checked before the pop, so the queue is drained once done is seen.
+                bool last = done.load(memory_order_acquire);
+                if (!queue.pop(t)) {
+                    if (last) break;
+                    continue;
+                }
+                if (!first && t <= prev) out_of_order.fetch_add(1, memory_order_relaxed);
+                first = false;
+                prev = t;
+                seen[t].fetch_add(1, memory_order_relaxed);
+            }
+        });
+    }
+    for (uint64_t t = 0; t < tasks; ++t) {
+        while (!queue.push(t)) {
+            asm volatile("pause" ::: "memory");
+        }
+    }
+    done.store(true, memory_order_release);
+    for (auto &th : threads) {
+        th.join();
+    }
+
+    uint64_t lost = 0, dup = 0;
+    for (auto &s : seen) {
+        lost += s.load() == 0;
+        dup += s.load() > 1;
+    }
+    LOG(INFO) << "SPMCQueue: " << tasks << " tasks, " << consumers << " consumers, lost " << lost << " duplicated "
+              << dup << " out of order " << out_of_order.load();
+    return lost == 0 && dup == 0 && out_of_order.load() == 0;
+}
+
+bool testPool() {
+    vector<atomic<uint8_t>> seen(tasks);
+    atomic<uint64_t> ran{ 0 };
+    vector<atomic<uint64_t>> per_worker(consumers);
+    WorkStealingPool<uint64_t> pool(consumers, 0, 1024, [&](uint64_t t, int w) {
+        seen[t].fetch_add(1, memory_order_relaxed);
+        per_worker[w].fetch_add(1, memory_order_relaxed);
+        ran.fetch_add(1, memory_order_release);
+    });
+    for (uint64_t t = 0; t < tasks; ++t) {
+        while (!pool.submit(t)) {
+            asm volatile("pause" ::: "memory");
+        }
+    }
+    while (ran.load(memory_order_acquire) < tasks) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    pool.stop();
+
+    uint64_t lost = 0, dup = 0;
+    for (auto &s : seen) {
+        lost += s.load() == 0;
+        dup += s.load() > 1;
+    }
+    ostringstream os;
+    for (auto &n : per_worker) {
+        os << " " << n.load();
+    }
+    LOG(INFO) << "WorkStealingPool: " << tasks << " tasks, lost " << lost << " duplicated " << dup << ", per worker"
+              << os.str();
+    return lost == 0 && dup == 0 && ran.load() == tasks;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) consumers = atoi(argv[1]);
+    if (argc > 2) tasks = atoll(argv[2]);
+    bool ok = testQueue();
+    ok = testPool() && ok;
+    LOG(INFO) << (ok ? "PASS" : "FAIL");
+    Logger::flush();
+    return ok ? 0 : 1;
+}
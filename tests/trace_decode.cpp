@@ -0,0 +1,12 @@
+#include "stdutils.h"
+
+// Converts a Tracer dump to Chrome trace JSON (chrome://tracing or ui.perfetto.dev).
+// trace_decode in.trace out.json
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        LOG(ERROR) << "Usage: " << argv[0] << " in.trace out.json";
+        return 1;
+    }
+    return Tracer::toChromeJson(argv[1], argv[2]) ? 0 : 1;
+}